@@ -0,0 +1,378 @@
+/* Copyright 2019, Jeffery Stager
+ *
+ * This file is part of librender.
+ *
+ * librender is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * librender is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with librender.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Headless benchmark for librender. Runs a fixed set of scenarios and
+ * prints the results as JSON on stdout, so it can run on a software ICD
+ * (e.g. lavapipe) in CI and be diffed between releases.
+ *
+ *   render_bench <vert.spv> <frag.spv> [frames]
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include "render.h"
+
+#include <error.h>              /* chkerr */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>             /* sysconf */
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 480
+#define BENCH_DEFAULT_FRAMES 500
+#define BENCH_INIT_SAMPLES 5
+/* Whole vertices, render_load() rejects a partial one */
+#define BENCH_UPLOAD_SIZE (sizeof(float) * 6 * 10 * 1024)
+#define BENCH_UPLOAD_COUNT 64
+
+static float quad_vertices[] = {
+  -0.5f, -0.5f, 0.0f,   1.0f, 0.0f, 0.0f,
+   0.5f, -0.5f, 0.0f,   0.0f, 1.0f, 0.0f,
+   0.5f,  0.5f, 0.0f,   0.0f, 0.0f, 1.0f,
+  -0.5f,  0.5f, 0.0f,   1.0f, 1.0f, 1.0f
+};
+
+static uint16_t quad_indices[] = { 0, 1, 2, 2, 3, 0 };
+
+static size_t draw_counts[] = { 1, 100, 1000, 10000 };
+
+/* Large enough that render_update() records them on the workers */
+static size_t worker_draw_counts[] = { 1000, 10000 };
+
+static double now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+
+  if (da < db) return -1;
+  return da > db;
+}
+
+/* Nearest-rank percentile of an already sorted sample set */
+static double percentile(double *samples, size_t n, double p) {
+  size_t rank = (size_t) (p / 100.0 * (double) n + 0.5);
+
+  if (rank < 1) rank = 1;
+  if (rank > n) rank = n;
+  return samples[rank - 1];
+}
+
+static void print_percentiles(const char *name, double *samples, size_t n) {
+  qsort(samples, n, sizeof(double), compare_doubles);
+  printf(
+    "\"%s\": { \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f }",
+    name,
+    percentile(samples, n, 50.0),
+    percentile(samples, n, 95.0),
+    percentile(samples, n, 99.0)
+  );
+}
+
+static int bench_init(char *vshader, char *fshader) {
+  double init_ms[BENCH_INIT_SAMPLES];
+  double configure_ms[BENCH_INIT_SAMPLES];
+  size_t i;
+
+  for (i = 0; i < BENCH_INIT_SAMPLES; ++i) {
+    struct render r;
+    double start;
+    int err;
+
+    start = now_ms();
+    err = render_init(&r, NULL);
+    if (err) return err;
+    init_ms[i] = now_ms() - start;
+    start = now_ms();
+    err = render_configure(&r, BENCH_WIDTH, BENCH_HEIGHT, vshader, fshader);
+    if (err) {
+      render_deinit(&r);
+      return err;
+    }
+    configure_ms[i] = now_ms() - start;
+    render_deinit(&r);
+  }
+  printf("  \"startup\": { \"samples\": %d, ", BENCH_INIT_SAMPLES);
+  print_percentiles("init_ms", init_ms, BENCH_INIT_SAMPLES);
+  printf(", ");
+  print_percentiles("configure_ms", configure_ms, BENCH_INIT_SAMPLES);
+  printf(" },\n");
+  return RENDER_ERROR_NONE;
+}
+
+static int load_quad(struct render *r, render_handle *out_mesh) {
+  return render_load(
+    r,
+    sizeof(quad_vertices),
+    quad_vertices,
+    sizeof(float) * 6,
+    sizeof(quad_indices) / sizeof(quad_indices[0]),
+    quad_indices,
+    sizeof(quad_indices[0]),
+    out_mesh
+  );
+}
+
+static int bench_frames(
+  struct render *r,
+  render_handle mesh,
+  size_t n_draws,
+  uint32_t n_instances,
+  size_t n_frames,
+  double *samples,
+  double *out_total_ms
+) {
+  struct render_draw_info info = { 0 };
+  double total;
+  size_t i, j;
+
+  info.mesh = mesh;
+  info.n_instances = n_instances;
+  total = now_ms();
+  for (i = 0; i < n_frames; ++i) {
+    double start = now_ms();
+
+    for (j = 0; j < n_draws; ++j) {
+      int err = render_draw(r, &info);
+
+      if (err) return err;
+    }
+    chkerr(render_update(r));
+    samples[i] = now_ms() - start;
+  }
+  *out_total_ms = now_ms() - total;
+  return RENDER_ERROR_NONE;
+}
+
+static int bench_steady(struct render *r, render_handle mesh, size_t n) {
+  double warmup[RENDER_MAX_FRAMES_IN_FLIGHT + 1];
+  double *samples;
+  double total_ms;
+  int err;
+
+  samples = malloc(sizeof(double) * n);
+  if (!samples) return RENDER_ERROR_MEMORY;
+  /* Warm up so the first frames' lazy allocations don't skew the tail */
+  err = bench_frames(r, mesh, 1, 1, r->n_frames + 1, warmup, &total_ms);
+  if (!err) err = bench_frames(r, mesh, 1, 1, n, samples, &total_ms);
+  if (err) {
+    free(samples);
+    return err;
+  }
+  printf("  \"steady\": { \"frames\": %lu, ", (unsigned long) n);
+  printf("\"fps\": %.2f, ", (double) n / (total_ms / 1e3));
+  print_percentiles("frame_ms", samples, n);
+  printf(" },\n");
+  free(samples);
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * render_load() goes through write_data(), either straight into mapped
+ * device memory or through the staging buffer. The loads are only
+ * complete once their frame's fence has signaled, so the clock runs
+ * until every frame in flight has come back around
+ */
+static int bench_upload(struct render *r) {
+  render_handle meshes[BENCH_UPLOAD_COUNT];
+  unsigned char *vertices;
+  size_t i, n_bytes = 0;
+  double start, elapsed;
+  int err = RENDER_ERROR_NONE;
+
+  vertices = calloc(1, BENCH_UPLOAD_SIZE);
+  if (!vertices) return RENDER_ERROR_MEMORY;
+  start = now_ms();
+  for (i = 0; i < BENCH_UPLOAD_COUNT && !err; ++i) {
+    err = render_load(
+      r,
+      BENCH_UPLOAD_SIZE,
+      vertices,
+      sizeof(float) * 6,
+      sizeof(quad_indices) / sizeof(quad_indices[0]),
+      quad_indices,
+      sizeof(quad_indices[0]),
+      meshes + i
+    );
+    n_bytes += BENCH_UPLOAD_SIZE + sizeof(quad_indices);
+  }
+  for (i = 0; i <= r->n_frames && !err; ++i) err = render_update(r);
+  elapsed = now_ms() - start;
+  free(vertices);
+  if (err) return err;
+  for (i = 0; i < BENCH_UPLOAD_COUNT; ++i) chkerr(render_unload(r, meshes[i]));
+  printf(
+    "  \"upload\": { \"bytes\": %lu, \"ms\": %.4f, \"mib_per_s\": %.2f },\n",
+    (unsigned long) n_bytes,
+    elapsed,
+    (double) n_bytes / (1024.0 * 1024.0) / (elapsed / 1e3)
+  );
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Frame times across draw_counts objects, drawn either one draw per
+ * object or as a single instanced draw
+ */
+static int bench_scaling(
+  struct render *r,
+  render_handle mesh,
+  size_t n,
+  const char *name,
+  int instanced,
+  int last
+) {
+  double *samples;
+  double total_ms;
+  size_t i, n_counts = sizeof(draw_counts) / sizeof(draw_counts[0]);
+
+  samples = malloc(sizeof(double) * n);
+  if (!samples) return RENDER_ERROR_MEMORY;
+  printf("  \"%s\": [\n", name);
+  for (i = 0; i < n_counts; ++i) {
+    size_t n_draws = instanced ? 1 : draw_counts[i];
+    uint32_t n_instances = instanced ? (uint32_t) draw_counts[i] : 1;
+    int err;
+
+    err = bench_frames(r, mesh, n_draws, n_instances, n, samples, &total_ms);
+    if (err) {
+      free(samples);
+      return err;
+    }
+    printf("    { \"objects\": %lu, ", (unsigned long) draw_counts[i]);
+    print_percentiles("frame_ms", samples, n);
+    printf(" }%s\n", i + 1 < n_counts ? "," : "");
+  }
+  printf("  ]%s\n", last ? "" : ",");
+  free(samples);
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Recording throughput by worker count: inline, one worker and one per
+ * core. Worker threads only take effect on configure, so each count gets
+ * a fresh configuration and mesh
+ */
+static int bench_workers(
+  struct render *r,
+  char *vshader,
+  char *fshader,
+  size_t n,
+  int last
+) {
+  size_t thread_counts[3];
+  size_t i, j, n_threads = 0;
+  size_t n_counts = sizeof(worker_draw_counts) / sizeof(worker_draw_counts[0]);
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  double warmup[RENDER_MAX_FRAMES_IN_FLIGHT + 1];
+  double *samples;
+  double total_ms;
+  int err = RENDER_ERROR_NONE;
+
+  thread_counts[n_threads++] = 0;
+  thread_counts[n_threads++] = 1;
+  if (cores > RENDER_MAX_WORKER_THREADS) cores = RENDER_MAX_WORKER_THREADS;
+  if (cores > 1) thread_counts[n_threads++] = (size_t) cores;
+  samples = malloc(sizeof(double) * n);
+  if (!samples) return RENDER_ERROR_MEMORY;
+  printf("  \"workers\": [\n");
+  for (i = 0; i < n_threads && !err; ++i) {
+    render_handle mesh;
+
+    err = render_set_worker_threads(r, thread_counts[i]);
+    if (!err) {
+      err = render_configure(r, BENCH_WIDTH, BENCH_HEIGHT, vshader, fshader);
+    }
+    if (!err) err = load_quad(r, &mesh);
+    if (!err) {
+      err = bench_frames(r, mesh, 1, 1, r->n_frames + 1, warmup, &total_ms);
+    }
+    for (j = 0; j < n_counts && !err; ++j) {
+      err = bench_frames(
+        r,
+        mesh,
+        worker_draw_counts[j],
+        1,
+        n,
+        samples,
+        &total_ms
+      );
+      if (err) break;
+      printf(
+        "    { \"threads\": %lu, \"objects\": %lu, ",
+        (unsigned long) thread_counts[i],
+        (unsigned long) worker_draw_counts[j]
+      );
+      print_percentiles("frame_ms", samples, n);
+      printf(" }%s\n", i + 1 < n_threads || j + 1 < n_counts ? "," : "");
+    }
+  }
+  free(samples);
+  if (err) return err;
+  printf("  ]%s\n", last ? "" : ",");
+  return RENDER_ERROR_NONE;
+}
+
+int main(int argc, char **argv) {
+  struct render r;
+  render_handle mesh;
+  size_t n_frames = BENCH_DEFAULT_FRAMES;
+  int err;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <vert.spv> <frag.spv> [frames]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 3) n_frames = (size_t) strtoul(argv[3], NULL, 10);
+  if (n_frames == 0) n_frames = BENCH_DEFAULT_FRAMES;
+  printf("{\n");
+  err = bench_init(argv[1], argv[2]);
+  if (err) goto fail;
+  err = render_init(&r, NULL);
+  if (err) goto fail;
+  err = render_configure(&r, BENCH_WIDTH, BENCH_HEIGHT, argv[1], argv[2]);
+  if (!err) err = load_quad(&r, &mesh);
+  if (!err) err = bench_steady(&r, mesh, n_frames);
+  if (!err) err = bench_upload(&r);
+  if (!err) err = bench_scaling(&r, mesh, n_frames, "draws", 0, 0);
+  if (!err) err = bench_scaling(&r, mesh, n_frames, "instances", 1, 0);
+  /* Same draws again, batched into indirect draws */
+  if (!err) err = render_set_draw_indirect(&r, 1);
+  if (!err) err = bench_scaling(&r, mesh, n_frames, "indirect", 0, 0);
+  /* Reconfigures, so mesh is gone after this */
+  if (!err) err = render_set_draw_indirect(&r, 0);
+  if (!err) err = bench_workers(&r, argv[1], argv[2], n_frames, 1);
+  render_deinit(&r);
+  if (err) goto fail;
+  printf("}\n");
+  return 0;
+
+fail:
+  fflush(stdout);
+  fprintf(stderr, "render_bench: error %d\n", err);
+  return 1;
+}
@@ -78,16 +78,440 @@ struct window;
 #define RENDER_ERROR_VULKAN_ACQUIRE_IMAGE             -40
 #define RENDER_ERROR_VULKAN_QUEUE_SUBMIT              -41
 #define RENDER_ERROR_VULKAN_QUEUE_PRESENT             -42
+#define RENDER_ERROR_VULKAN_FENCE                     -43
+#define RENDER_ERROR_ARGUMENT                         -44
+#define RENDER_ERROR_VULKAN_MEMORY_TYPE               -45
+#define RENDER_ERROR_RING_FULL                        -46
+#define RENDER_ERROR_HANDLE                           -47
+#define RENDER_ERROR_VULKAN_PIPELINE_CACHE            -48
+#define RENDER_ERROR_VULKAN_QUERY_POOL                -49
+#define RENDER_ERROR_UNSUPPORTED                      -50
+#define RENDER_ERROR_THREAD                           -51
+#define RENDER_ERROR_DEVICE_NOT_FOUND                 -52
+#define RENDER_ERROR_VULKAN_DESCRIPTOR_POOL           -53
+#define RENDER_ERROR_VULKAN_DESCRIPTOR_SET            -54
+
+/* Swapchain images asked for unless render_set_image_count() says otherwise */
+#define RENDER_DEFAULT_IMAGE_COUNT 2
+
+/* Number of frames the CPU may record ahead of the GPU */
+#define RENDER_MAX_FRAMES_IN_FLIGHT     4
+#define RENDER_DEFAULT_FRAMES_IN_FLIGHT 2
 
 /* Easily get vulkan function definitions */
 #define vkfunc(f) PFN_##f f
 
+/* Size of each VkDeviceMemory block that allocations are carved from */
+#define RENDER_MEMORY_BLOCK_SIZE ((VkDeviceSize) 64 * 1024 * 1024)
+
+struct render_memory_range {
+  VkDeviceSize offset;
+  VkDeviceSize size;
+};
+
+/* Free ranges sorted by offset, neighbours are always coalesced */
+struct render_range_list {
+  size_t n;
+  size_t cap;
+  struct render_memory_range *ranges;
+};
+
+struct render_memory_block {
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  uint32_t type_index;
+  void *mapped;                 /* persistently mapped if host visible */
+  struct render_range_list free;
+};
+
+struct render_allocation {
+  VkDeviceMemory memory;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  size_t block;
+  void *mapped;                 /* NULL unless host visible */
+};
+
+/* Host visible buffer that device local uploads are staged through */
+#define RENDER_STAGING_SIZE ((VkDeviceSize) 8 * 1024 * 1024)
+
+struct render_upload {
+  VkBuffer staging_buffer;
+  struct render_allocation staging_alloc;
+  VkDeviceSize staging_used;
+  VkCommandPool command_pool;   /* on the transfer family */
+  VkCommandBuffer command_buffer;
+  VkFence fence;
+  int recording;                /* copies recorded but not yet submitted */
+  int in_flight;                /* submitted and fence not yet waited on */
+  /* Only used with a dedicated transfer queue */
+  VkSemaphore semaphore;        /* the frame's batch, waited on by its submit */
+  int signaled;                 /* semaphore pending a wait */
+  size_t n_barriers;            /* released ranges in the recording batch */
+  size_t n_acquires;            /* released and not yet acquired */
+  size_t cap_acquires;
+  VkBufferMemoryBarrier *acquires;
+};
+
+/* Default size of the per-frame ring buffer for streamed data */
+#define RENDER_DEFAULT_RING_SIZE ((VkDeviceSize) 4 * 1024 * 1024)
+
+/**
+ * head and tail only ever grow, the byte offset into the buffer is the
+ * position modulo size
+ */
+struct render_ring {
+  VkBuffer buffer;
+  struct render_allocation alloc;
+  VkDeviceSize size;
+  VkDeviceSize head;            /* next byte handed out */
+  VkDeviceSize tail;            /* oldest byte the GPU may still read */
+  VkDeviceSize frame_start;     /* head when the current frame began */
+  int coherent;
+};
+
+/* A range of the ring buffer valid until the frame using it retires */
+struct render_ring_range {
+  void *data;
+  VkBuffer buffer;
+  VkDeviceSize offset;
+};
+
+/* GPU timestamp regions recorded per frame, see render_begin_region() */
+#define RENDER_MAX_GPU_REGIONS 31
+#define RENDER_GPU_LABEL_SIZE  32
+/* One pair around the render pass plus one pair per region */
+#define RENDER_MAX_GPU_QUERIES (2 + 2 * RENDER_MAX_GPU_REGIONS)
+
+#ifdef RENDER_PROFILE
+
+/* CPU stage profiler, compiled in with -DRENDER_PROFILE */
+#define RENDER_PROFILE_EVENTS 4096
+#define RENDER_PROFILE_DEPTH  16
+
+struct render_profile_event {
+  const char *name;
+  uint64_t start_ns;            /* CLOCK_MONOTONIC */
+  uint64_t duration_ns;
+  size_t depth;
+};
+
+#endif  /* RENDER_PROFILE */
+
+/* Generation checked index into a handle table, 0 is never valid */
+typedef uint32_t render_handle;
+#define RENDER_HANDLE_NULL 0
+
+struct render_handle_slot {
+  uint32_t generation;
+  int live;
+};
+
+/* Items are stored inline, so pointers to them move when the table grows */
+struct render_handle_table {
+  size_t item_size;
+  size_t n;
+  size_t cap;
+  unsigned char *items;
+  struct render_handle_slot *slots;
+  size_t n_free;
+  uint32_t *free;
+};
+
+/* Size of the shared buffers that meshes are packed into */
+#define RENDER_GEOMETRY_VERTEX_SIZE ((VkDeviceSize) 32 * 1024 * 1024)
+#define RENDER_GEOMETRY_INDEX_SIZE  ((VkDeviceSize) 16 * 1024 * 1024)
+
+struct render_geometry {
+  VkBuffer vertex_buffer;
+  VkBuffer index_buffer;
+  struct render_allocation vertex_alloc;
+  struct render_allocation index_alloc;
+  struct render_range_list vertex_free;
+  struct render_range_list index_free;
+};
+
+struct render_mesh {
+  size_t geometry;
+  VkDeviceSize vertex_offset;
+  VkDeviceSize vertex_size;
+  VkDeviceSize index_offset;
+  VkDeviceSize index_size;
+  int32_t first_vertex;
+  uint32_t first_index;
+  uint32_t n_indices;
+  VkIndexType index_type;
+  uint64_t serial;              /* once unloaded, last frame that may use it */
+};
+
+/**
+ * Meshes feed locations 0 and 1 (vec3 position, vec3 color) from binding
+ * 0. A per-instance stream is bound at binding 1, its attributes taking
+ * the locations from RENDER_INSTANCE_LOCATION on in order
+ */
+#define RENDER_INSTANCE_BINDING     1
+#define RENDER_INSTANCE_LOCATION    2
+#define RENDER_MAX_INSTANCE_ATTRS   14
+#define RENDER_MAX_VERTEX_ATTRS     (2 + RENDER_MAX_INSTANCE_ATTRS)
+
+struct render_vertex_attr {
+  VkFormat format;
+  uint32_t offset;              /* within one instance's data */
+};
+
+/* Fixed-function state of a pipeline, zero being the default */
+#define RENDER_TOPOLOGY_TRIANGLES      0
+#define RENDER_TOPOLOGY_TRIANGLE_STRIP 1
+#define RENDER_TOPOLOGY_LINES          2
+#define RENDER_TOPOLOGY_POINTS         3
+
+#define RENDER_CULL_BACK  0
+#define RENDER_CULL_NONE  1
+#define RENDER_CULL_FRONT 2
+
+#define RENDER_BLEND_NONE     0
+#define RENDER_BLEND_ALPHA    1
+#define RENDER_BLEND_ADDITIVE 2
+
+struct render_pipeline_info {
+  char *vshader;                /* path to SPIR-V vertex shader */
+  char *fshader;                /* path to SPIR-V fragment shader */
+  size_t instance_stride;       /* 0 for no per-instance stream */
+  size_t n_instance_attrs;
+  struct render_vertex_attr *instance_attrs;
+  /**
+   * Bytes of push constants at offset 0, visible to both stages. A
+   * multiple of 4 no bigger than the device's maxPushConstantsSize
+   */
+  size_t push_constant_size;
+  int topology;                 /* RENDER_TOPOLOGY_* */
+  int cull;                     /* RENDER_CULL_* */
+  int blend;                    /* RENDER_BLEND_* */
+};
+
+/**
+ * Everything a pipeline is built from but the render pass, which they all
+ * share. Hashed and compared bytewise, so zeroed before being filled in
+ */
+struct render_pipeline_desc {
+  /* Shared by content, see acquire_shader(), so they stand for the SPIR-V */
+  VkShaderModule vert_module;
+  VkShaderModule frag_module;
+  uint32_t push_constant_size;
+  int topology;
+  int cull;
+  int blend;
+  uint32_t n_bindings;
+  uint32_t n_attrs;
+  VkVertexInputBindingDescription bindings[2];
+  VkVertexInputAttributeDescription attrs[RENDER_MAX_VERTEX_ATTRS];
+};
+
+/* Returned by render_pipeline_status(), or the error compiling it */
+#define RENDER_PIPELINE_PENDING 0
+#define RENDER_PIPELINE_READY   1
+
+/* Background compile threads unless render_set_compile_threads() says */
+#define RENDER_DEFAULT_COMPILE_THREADS 1
+
+struct render_pipeline {
+  VkPipeline pipeline;          /* VK_NULL_HANDLE until compiled */
+  int status;                   /* RENDER_PIPELINE_* or an error */
+  render_handle fallback;       /* drawn with while pending */
+  VkPipelineLayout layout;      /* shared, see acquire_layout() */
+  struct render_pipeline_desc desc;
+  uint64_t hash;                /* of desc */
+  size_t refs;                  /* render_add_pipeline() calls answered */
+  render_handle next;           /* in its pipeline_buckets chain */
+};
+
+/* A module shared by every pipeline built from the same SPIR-V */
+struct render_shader {
+  char *path;                   /* the first one it was read from */
+  uint64_t hash;
+  size_t len;
+  unsigned char *source;        /* hashes can collide, so kept to compare */
+  size_t refs;
+  VkShaderModule module;
+};
+
+/* Pipeline layouts only differ in their push constant range */
+struct render_layout {
+  uint32_t push_constant_size;
+  size_t refs;
+  VkPipelineLayout layout;
+};
+
+/**
+ * Largest per-draw data, which shaders see as a uniform buffer at set 0,
+ * binding 0. The descriptor covers this much behind every draw's offset
+ */
+#define RENDER_MAX_DRAW_DATA 256
+
+struct render_draw_info {
+  render_handle pipeline;       /* RENDER_HANDLE_NULL for the default */
+  render_handle mesh;
+  void *data;                   /* optional per-draw data, copied */
+  size_t data_size;             /* up to RENDER_MAX_DRAW_DATA */
+  uint32_t n_instances;         /* 0 and 1 both draw a single instance */
+  /**
+   * n_instances times the pipeline's instance stride, copied into the
+   * ring. When NULL, instance_offset locates data already written this
+   * frame through render_ring_alloc()
+   */
+  void *instances;
+  VkDeviceSize instance_offset;
+  /**
+   * Optional push constants, copied. Cheaper than data for anything that
+   * fits the pipeline's push_constant_size, and allowed in static mode
+   */
+  void *push_data;
+  size_t push_size;
+};
+
+struct render_draw_item {
+  uint64_t key;                 /* sort key, see render_draw() */
+  size_t order;                 /* submission order, breaks key ties */
+  render_handle pipeline;
+  render_handle mesh;
+  VkDeviceSize data_offset;     /* into the ring buffer */
+  size_t data_size;
+  uint32_t n_instances;
+  VkDeviceSize instance_offset; /* into the ring buffer */
+  size_t push_offset;           /* into push_data */
+  uint32_t push_size;
+  /* Set at record time, see pack_indirect() */
+  uint32_t batch_size;          /* 0 when folded into an earlier draw */
+  VkDeviceSize indirect_offset; /* of the batch's commands in the ring */
+};
+
+/**
+ * Dynamic re-records the draw list every frame and then clears it. Static
+ * keeps the list and replays command buffers recorded once per swapchain
+ * image, re-recording only after the list changes
+ */
+#define RENDER_RECORD_DYNAMIC 0
+#define RENDER_RECORD_STATIC  1
+
+#define RENDER_MARKER_BEGIN_REGION 0
+#define RENDER_MARKER_END_REGION   1
+#define RENDER_MARKER_VIEWPORT     2
+
+/* Pixels of the render target, a zero width or height meaning all of it */
+struct render_viewport {
+  int32_t x;
+  int32_t y;
+  uint32_t width;
+  uint32_t height;
+};
+
+/* Applies in front of the first draw of its segment once sorted */
+struct render_draw_marker {
+  uint32_t segment;
+  int type;                     /* RENDER_MARKER_* */
+  char label[RENDER_GPU_LABEL_SIZE];
+  struct render_viewport viewport;
+  uint32_t query;               /* timestamp written, or RENDER_QUERY_NONE */
+};
+
+#define RENDER_QUERY_NONE ((uint32_t) -1)
+
+struct render_gpu_region {
+  char label[RENDER_GPU_LABEL_SIZE];
+  uint64_t ns;
+};
+
+struct render_gpu_timings {
+  uint64_t serial;              /* frame the timings belong to */
+  uint64_t render_pass_ns;
+  size_t n_regions;
+  struct render_gpu_region regions[RENDER_MAX_GPU_REGIONS];
+};
+
+/* How well the pipeline cache served this configuration */
+struct render_pipeline_cache_stats {
+  int loaded;                   /* initial data came from the cache file */
+  size_t n_pipelines;           /* pipelines created since configure */
+  size_t n_hits;                /* served from the cache */
+  size_t n_misses;              /* compiled from scratch */
+  size_t n_reused;              /* requests answered by an existing one */
+};
+
+/* The physical device render_configure() settled on */
+struct render_device_info {
+  size_t index;                 /* into phys_devices */
+  char name[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE];
+  uint8_t uuid[VK_UUID_SIZE];   /* zero without Vulkan 1.1 */
+  VkPhysicalDeviceType type;
+  VkDeviceSize vram;            /* device local heaps, in bytes */
+  uint64_t score;
+  int overridden;               /* picked by render_set_device() */
+};
+
+struct render_swapchain_info {
+  VkPresentModeKHR present_mode;
+  size_t n_images;
+  VkExtent2D extent;
+};
+
+/* Worker threads recording secondary command buffers, see render.c */
+#define RENDER_MAX_WORKER_THREADS 16
+#define RENDER_DRAWS_PER_CHUNK    256
+
+struct render_workers;
+struct render_compiler;
+
+/* Jobs submitted together, waited on as one */
+struct render_job_group {
+  size_t remaining;             /* guarded by the worker pool's lock */
+};
+
+/* Command pools are externally synchronized, so each thread has its own */
+struct render_thread_pool {
+  VkCommandPool pool;
+  size_t n_buffers;
+  VkCommandBuffer *buffers;     /* secondary, reused once the pool resets */
+  size_t used;                  /* handed out this frame */
+};
+
+/* A slice of the sorted draw list recorded into one secondary buffer */
+struct render_record_chunk {
+  struct render *r;
+  uint32_t image_index;
+  size_t first_draw;
+  size_t end_draw;
+  size_t first_marker;
+  size_t end_marker;
+  VkCommandBuffer buffer;
+  int err;
+};
+
+/* Synchronization owned by a single frame in flight */
+struct render_frame {
+  VkSemaphore image_semaphore;
+  VkSemaphore render_semaphore;
+  VkSemaphore present_semaphore; /* present family owns the image */
+  VkFence fence;
+  VkCommandPool command_pool;   /* reset as a whole before re-recording */
+  VkCommandBuffer command_buffer;
+  VkCommandBuffer acquire_buffer; /* takes ownership of uploaded ranges */
+  VkDeviceSize ring_end;        /* ring head when this frame was submitted */
+  uint64_t serial;              /* value of frame_serial at submission */
+  VkQueryPool query_pool;       /* timestamps, when GPU timing is enabled */
+  uint32_t n_queries;           /* written by the last submission */
+  size_t n_regions;
+  struct render_gpu_region regions[RENDER_MAX_GPU_REGIONS];
+  size_t n_thread_pools;        /* one per worker plus the calling thread */
+  struct render_thread_pool *thread_pools;
+};
+
 struct render {
   void *vklib;
 
   /* Pre-instance functions */
   vkfunc(vkGetInstanceProcAddr);
   vkfunc(vkCreateInstance);
+  vkfunc(vkEnumerateInstanceVersion); /* NULL on 1.0 loaders */
   vkfunc(vkDestroyInstance);
 
   /* Instance functions */
@@ -101,10 +525,14 @@ struct render {
   vkfunc(vkGetPhysicalDeviceSurfaceSupportKHR);
   vkfunc(vkGetPhysicalDeviceSurfaceCapabilitiesKHR);
   vkfunc(vkGetPhysicalDeviceSurfaceFormatsKHR);
+  vkfunc(vkGetPhysicalDeviceSurfacePresentModesKHR);
   vkfunc(vkGetPhysicalDeviceMemoryProperties);
   vkfunc(vkDestroyDevice);
   vkfunc(vkDestroySwapchainKHR);
   vkfunc(vkDestroySurfaceKHR);
+  vkfunc(vkEnumerateDeviceExtensionProperties);
+  vkfunc(vkGetPhysicalDeviceFeatures);
+  vkfunc(vkGetPhysicalDeviceProperties2); /* NULL on 1.0 instances */
 
   /* Device functions */
   vkfunc(vkCreateSwapchainKHR);
@@ -130,7 +558,12 @@ struct render {
   vkfunc(vkCmdBindPipeline);
   vkfunc(vkCmdBindVertexBuffers);
   vkfunc(vkCmdBindIndexBuffer);
+  vkfunc(vkCmdBindDescriptorSets);
+  vkfunc(vkCmdPushConstants);
+  vkfunc(vkCmdSetViewport);
+  vkfunc(vkCmdSetScissor);
   vkfunc(vkCmdDrawIndexed);
+  vkfunc(vkCmdDrawIndexedIndirect);
   vkfunc(vkCmdEndRenderPass);
   vkfunc(vkEndCommandBuffer);
   vkfunc(vkCreateSemaphore);
@@ -151,43 +584,172 @@ struct render {
   vkfunc(vkDestroySemaphore);
   vkfunc(vkCreateDescriptorSetLayout);
   vkfunc(vkDestroyDescriptorSetLayout);
+  vkfunc(vkCreateDescriptorPool);
+  vkfunc(vkDestroyDescriptorPool);
+  vkfunc(vkAllocateDescriptorSets);
+  vkfunc(vkUpdateDescriptorSets);
+  vkfunc(vkCreateFence);
+  vkfunc(vkDestroyFence);
+  vkfunc(vkWaitForFences);
+  vkfunc(vkResetFences);
+  vkfunc(vkDeviceWaitIdle);
+  vkfunc(vkResetCommandPool);
+  vkfunc(vkCmdCopyBuffer);
+  vkfunc(vkCmdPipelineBarrier);
+  vkfunc(vkCreatePipelineCache);
+  vkfunc(vkDestroyPipelineCache);
+  vkfunc(vkGetPipelineCacheData);
+  vkfunc(vkCreateImage);
+  vkfunc(vkDestroyImage);
+  vkfunc(vkGetImageMemoryRequirements);
+  vkfunc(vkBindImageMemory);
+  vkfunc(vkCreateQueryPool);
+  vkfunc(vkDestroyQueryPool);
+  vkfunc(vkGetQueryPoolResults);
+  vkfunc(vkCmdResetQueryPool);
+  vkfunc(vkCmdWriteTimestamp);
+  vkfunc(vkCmdExecuteCommands);
 
   /* Vulkan state */
+  int headless;                 /* no window, render_init() got NULL */
   VkInstance instance;
   size_t n_devices;
   size_t phys_id;
+  uint32_t api_version;         /* of the instance */
+  char *wanted_device_name;     /* substring of deviceName, or NULL */
+  int has_wanted_uuid;
+  uint8_t wanted_device_uuid[VK_UUID_SIZE];
+  struct render_device_info device_info;
   VkPhysicalDevice *phys_devices;
+  VkPhysicalDeviceProperties phys_props;
+  VkPhysicalDeviceFeatures phys_features;
+  VkPhysicalDeviceMemoryProperties memory_props;
   VkSurfaceKHR surface;
   size_t n_queue_props;
   size_t queue_index_graphics;
   size_t queue_index_present;
+  size_t queue_index_transfer;
+  int has_transfer_queue;       /* a family separate from graphics */
   VkQueueFamilyProperties *queue_props;
   VkDevice device;
   VkSurfaceFormatKHR format;
   VkSwapchainKHR swapchain;
+  VkExtent2D requested_extent;  /* used when the surface leaves it to us */
   VkExtent2D swap_extent;
-  VkBuffer vertex_buffer;
-  VkBuffer index_buffer;
-  VkDeviceMemory vertex_memory;
-  VkDeviceMemory index_memory;
+  int swapchain_dirty;          /* out of date, recreate before next frame */
+  VkPresentModeKHR wanted_present_mode;
+  size_t wanted_image_count;
+  VkPresentModeKHR present_mode;
   VkQueue graphics_queue;
   VkQueue present_queue;
+  VkQueue transfer_queue;       /* graphics_queue without a dedicated one */
   VkDescriptorSetLayout descriptor_set_layout;
+  /* Sized up front, nothing is allocated from it once configured */
+  VkDescriptorPool descriptor_pool;
+  /* Per frame, the ring as a dynamic uniform buffer */
+  VkDescriptorSet descriptor_sets[RENDER_MAX_FRAMES_IN_FLIGHT];
+  VkDeviceSize uniform_range;   /* bytes each dynamic offset exposes */
+
+  /* Device memory */
+  size_t n_memory_blocks;
+  struct render_memory_block *memory_blocks;
+  struct render_upload upload;
+  VkDeviceSize ring_size;
+  struct render_ring ring;
+
+  /* Meshes */
+  size_t n_geometry;
+  struct render_geometry *geometry;
+  struct render_handle_table meshes;
+  size_t n_retired_meshes;
+  size_t cap_retired_meshes;
+  struct render_mesh *retired_meshes;
+
+  /* Draw list for the frame being recorded */
+  size_t n_draws;
+  size_t cap_draws;
+  struct render_draw_item *draws;
+  size_t push_used;
+  size_t cap_push;
+  unsigned char *push_data;     /* push constants of the listed draws */
+  uint32_t draw_segment;        /* bumped by every marker */
+  int draw_indirect;            /* batch runs into indirect draws */
+  size_t n_markers;
+  size_t cap_markers;
+  struct render_draw_marker *markers;
 
   /* Pipeline */
   int has_pipeline;
   /* VkShaderModule vert_module; */
   /* VkShaderModule frag_module; */
   VkRenderPass render_pass;
-  VkPipeline pipeline;
+  struct render_handle_table pipelines;
+  size_t n_buckets;             /* power of two, 0 before the first */
+  render_handle *pipeline_buckets;    /* chains of pipelines by hash */
+  size_t n_indexed;
+  size_t n_shaders;
+  size_t cap_shaders;
+  struct render_shader *shaders;
+  size_t n_layouts;
+  size_t cap_layouts;
+  struct render_layout *layouts;
+  render_handle default_pipeline;
+  char *pipeline_cache_path;
+  VkPipelineCache pipeline_cache;
+  int has_creation_feedback;    /* VK_EXT_pipeline_creation_feedback */
+  struct render_pipeline_cache_stats pipeline_cache_stats;
   size_t n_swapchain_images;
-  VkImage *swapchain_images;
+  VkImage *swapchain_images;    /* offscreen targets when headless */
+  struct render_allocation *target_allocs;
+  size_t target_index;          /* next offscreen target to render into */
   VkImageView *image_views;
   VkFramebuffer *framebuffers;
-  VkCommandPool command_pool;
-  VkCommandBuffer *command_buffers;
-  VkSemaphore image_semaphore;
-  VkSemaphore render_semaphore;
+  VkCommandPool command_pool;   /* static buffers */
+  VkCommandPool present_pool;   /* on the present family, when separate */
+  VkCommandBuffer *present_buffers;   /* one per swapchain image */
+
+  /* Recording */
+  int record_mode;              /* RENDER_RECORD_* */
+  uint64_t draws_generation;    /* bumped whenever the draw list changes */
+  VkCommandBuffer *static_buffers;    /* one per swapchain image */
+  uint64_t *static_generations; /* draws_generation each was recorded at */
+
+  /* Frames in flight */
+  size_t frames_in_flight;
+  size_t n_frames;
+  size_t frame_index;
+  int frame_begun;
+  uint64_t frame_serial;        /* number of frames submitted */
+  uint64_t completed_serial;    /* newest frame known to have finished */
+  struct render_frame frames[RENDER_MAX_FRAMES_IN_FLIGHT];
+  VkFence *image_fences;
+
+  /* GPU timing */
+  int wants_gpu_timing;
+  int gpu_timing;               /* enabled and supported by the queue */
+  uint64_t timestamp_mask;      /* timestampValidBits of the queue */
+  struct render_gpu_timings gpu_timings;
+
+  /* Multi-threaded recording */
+  size_t wanted_workers;
+  struct render_workers *workers;
+  size_t n_chunks;
+  size_t cap_chunks;
+  struct render_record_chunk *chunks;
+  VkCommandBuffer *chunk_buffers;
+
+  /* Background pipeline compilation, see render_add_pipeline_async() */
+  size_t wanted_compile_threads;
+  struct render_compiler *compiler; /* started by the first request */
+
+#ifdef RENDER_PROFILE
+  /* CPU profiler ring buffer, oldest event at head - count */
+  size_t profile_head;
+  size_t profile_count;
+  size_t profile_depth;
+  uint64_t profile_starts[RENDER_PROFILE_DEPTH];
+  struct render_profile_event profile_events[RENDER_PROFILE_EVENTS];
+#endif
 };
 
 /* **************************************** */
@@ -202,9 +764,70 @@ int render_configure(
   char *fshader
 );
 void render_destroy_pipeline(struct render *r);
+int render_resize(struct render *r, unsigned int width, unsigned int height);
+int render_set_present_mode(struct render *r, VkPresentModeKHR mode);
+int render_set_image_count(struct render *r, size_t n);
+int render_get_swapchain_info(
+  struct render *r,
+  struct render_swapchain_info *out
+);
+int render_set_device(
+  struct render *r,
+  const char *name,
+  const uint8_t *uuid
+);
+int render_get_device_info(struct render *r, struct render_device_info *out);
+int render_set_frames_in_flight(struct render *r, size_t n);
+int render_set_ring_size(struct render *r, size_t size);
+int render_set_worker_threads(struct render *r, size_t n);
+int render_ring_alloc(
+  struct render *r,
+  size_t size,
+  size_t alignment,
+  struct render_ring_range *out
+);
+int render_set_pipeline_cache_path(struct render *r, const char *path);
+int render_save_pipeline_cache(struct render *r);
+int render_get_pipeline_cache_stats(
+  struct render *r,
+  struct render_pipeline_cache_stats *out
+);
+int render_set_gpu_timing(struct render *r, int enabled);
+int render_begin_region(struct render *r, const char *label);
+int render_end_region(struct render *r);
+int render_get_gpu_timings(struct render *r, struct render_gpu_timings *out);
+int render_profile_dump(struct render *r, const char *path);
 int render_update(struct render *r);
-int render_draw(struct render *r);
-int render_load(struct render *r, size_t n, void *data);
+int render_add_pipeline(
+  struct render *r,
+  struct render_pipeline_info *info,
+  render_handle *out_pipeline
+);
+int render_add_pipeline_async(
+  struct render *r,
+  struct render_pipeline_info *info,
+  render_handle fallback,
+  render_handle *out_pipeline
+);
+int render_pipeline_status(struct render *r, render_handle pipeline);
+int render_set_compile_threads(struct render *r, size_t n);
+int render_remove_pipeline(struct render *r, render_handle pipeline);
+int render_draw(struct render *r, struct render_draw_info *info);
+int render_set_record_mode(struct render *r, int mode);
+int render_set_draw_indirect(struct render *r, int enabled);
+int render_set_viewport(struct render *r, const struct render_viewport *area);
+int render_clear_draws(struct render *r);
+int render_load(
+  struct render *r,
+  size_t n,
+  void *data,
+  size_t stride,
+  size_t n_indices,
+  void *indices,
+  size_t index_size,
+  render_handle *out_mesh
+);
+int render_unload(struct render *r, render_handle mesh);
 /* **************************************** */
 
 #endif
@@ -16,6 +16,8 @@
  * along with librender.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200112L /* pthreads, clock_gettime */
+
 #include "render.h"
 
 #include <error.h>              /* chkerr, chkerrf */
@@ -34,10 +36,57 @@ xcb_window_t window_xcb_window(struct window *w);
 
 #endif	/* TARGET_OS_LINUX */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef RENDER_PROFILE
+
+#include <time.h>
+
+static uint64_t profile_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void profile_begin(struct render *r) {
+  if (r->profile_depth < RENDER_PROFILE_DEPTH) {
+    r->profile_starts[r->profile_depth] = profile_now();
+  }
+  ++r->profile_depth;
+}
+
+/* Passes the step's result through so it can wrap a chkerr() argument */
+static int profile_end(struct render *r, const char *name, int result) {
+  struct render_profile_event *e;
+
+  if (r->profile_depth == 0) return result;
+  if (--r->profile_depth >= RENDER_PROFILE_DEPTH) return result;
+  e = r->profile_events + r->profile_head;
+  e->name = name;
+  e->start_ns = r->profile_starts[r->profile_depth];
+  e->duration_ns = profile_now() - e->start_ns;
+  e->depth = r->profile_depth;
+  r->profile_head = (r->profile_head + 1) % RENDER_PROFILE_EVENTS;
+  if (r->profile_count < RENDER_PROFILE_EVENTS) ++r->profile_count;
+  return result;
+}
+
+/* Times a call, named after its source text */
+#define profiled(r, call) profile_end(r, #call, (profile_begin(r), (call)))
+#define profiled_vk(r, name, call) \
+  ((VkResult) profile_end(r, name, (profile_begin(r), (int) (call))))
+
+#else
+
+#define profiled(r, call) (call)
+#define profiled_vk(r, name, call) (call)
+
+#endif  /* RENDER_PROFILE */
+
 static int load_vulkan(struct render *r) {
   /**
    * WARNING: this won't work on systems where object pointers and function
@@ -49,6 +98,8 @@ static int load_vulkan(struct render *r) {
   } dlsym_result;
 
   r->vklib = dlopen("libvulkan.so", RTLD_NOW);
+  /* Runtime-only installs (CI images, containers) lack the dev symlink */
+  if (!r->vklib) r->vklib = dlopen("libvulkan.so.1", RTLD_NOW);
   if (!r->vklib) return RENDER_ERROR_VULKAN_LOAD;
 
   /**
@@ -70,6 +121,9 @@ static int load_preinstance_functions(struct render *r) {
     return RENDER_ERROR_VULKAN_PREINST_LOAD;
 
   load(vkCreateInstance);
+  /* Added in Vulkan 1.1, so its absence isn't an error */
+  r->vkEnumerateInstanceVersion = (PFN_vkEnumerateInstanceVersion)
+    r->vkGetInstanceProcAddr(NULL, "vkEnumerateInstanceVersion");
   return RENDER_ERROR_NONE;
 
 #undef load
@@ -80,11 +134,26 @@ static int create_instance(struct render *r) {
     "VK_KHR_surface",
     "VK_KHR_xcb_surface"
   };
+  VkApplicationInfo app_info = { 0 };
   VkInstanceCreateInfo create_info = { 0 };
   VkResult result;
 
+  /* 1.1 where the loader has it, device UUIDs need it */
+  r->api_version = VK_API_VERSION_1_0;
+  if (r->vkEnumerateInstanceVersion) {
+    uint32_t version;
+
+    result = r->vkEnumerateInstanceVersion(&version);
+    if (result == VK_SUCCESS && version >= VK_API_VERSION_1_1) {
+      r->api_version = VK_API_VERSION_1_1;
+    }
+  }
+  app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+  app_info.apiVersion = r->api_version;
   create_info.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-  create_info.enabledExtensionCount = 2;
+  create_info.pApplicationInfo = &app_info;
+  /* Headless renders into plain images and needs no surface support */
+  create_info.enabledExtensionCount = r->headless ? 0 : 2;
   create_info.ppEnabledExtensionNames = (const char * const *) extensions;
   result = r->vkCreateInstance(&create_info, NULL, &r->instance);
   if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_INSTANCE;
@@ -99,25 +168,33 @@ static int load_instance_functions(struct render *r) {
   load(vkGetDeviceProcAddr);
   load(vkEnumeratePhysicalDevices);
   load(vkGetPhysicalDeviceProperties);
-  load(vkCreateXcbSurfaceKHR);
   load(vkGetPhysicalDeviceQueueFamilyProperties);
   load(vkCreateDevice);
   load(vkGetDeviceQueue);
-  load(vkGetPhysicalDeviceSurfaceSupportKHR);
-  load(vkGetPhysicalDeviceSurfaceFormatsKHR);
-  load(vkGetPhysicalDeviceSurfaceCapabilitiesKHR);
   load(vkGetPhysicalDeviceMemoryProperties);
   load(vkCreateImageView);
   load(vkCreateFramebuffer);
   load(vkCreateCommandPool);
   load(vkDestroyDevice);
-  load(vkDestroySwapchainKHR);
-  load(vkDestroySurfaceKHR);
   load(vkDestroyInstance);
   load(vkDestroyImageView);
   load(vkDestroyFramebuffer);
   load(vkDestroyCommandPool);
   load(vkFreeCommandBuffers);
+  load(vkEnumerateDeviceExtensionProperties);
+  load(vkGetPhysicalDeviceFeatures);
+  if (r->api_version >= VK_API_VERSION_1_1) {
+    r->vkGetPhysicalDeviceProperties2 = (PFN_vkGetPhysicalDeviceProperties2)
+      r->vkGetInstanceProcAddr(r->instance, "vkGetPhysicalDeviceProperties2");
+  }
+  if (r->headless) return RENDER_ERROR_NONE;
+  load(vkCreateXcbSurfaceKHR);
+  load(vkGetPhysicalDeviceSurfaceSupportKHR);
+  load(vkGetPhysicalDeviceSurfaceFormatsKHR);
+  load(vkGetPhysicalDeviceSurfacePresentModesKHR);
+  load(vkGetPhysicalDeviceSurfaceCapabilitiesKHR);
+  load(vkDestroySwapchainKHR);
+  load(vkDestroySurfaceKHR);
   return RENDER_ERROR_NONE;
 
 #undef load
@@ -147,12 +224,10 @@ static int load_device_functions(struct render *r) {
   if (!(r->f = (PFN_##f) r->vkGetDeviceProcAddr(r->device, #f))) \
     return RENDER_ERROR_VULKAN_DEVICE_FUNC_LOAD;
 
-  load(vkCreateSwapchainKHR);
   load(vkCreateShaderModule);
   load(vkCreatePipelineLayout);
   load(vkCreateRenderPass);
   load(vkCreateGraphicsPipelines);
-  load(vkGetSwapchainImagesKHR);
   load(vkAllocateCommandBuffers);
   load(vkCreateBuffer);
   load(vkGetBufferMemoryRequirements);
@@ -167,13 +242,16 @@ static int load_device_functions(struct render *r) {
   load(vkCmdBindPipeline);
   load(vkCmdBindVertexBuffers);
   load(vkCmdBindIndexBuffer);
+  load(vkCmdBindDescriptorSets);
+  load(vkCmdPushConstants);
+  load(vkCmdSetViewport);
+  load(vkCmdSetScissor);
   load(vkCmdDrawIndexed);
+  load(vkCmdDrawIndexedIndirect);
   load(vkCmdEndRenderPass);
   load(vkEndCommandBuffer);
   load(vkCreateSemaphore);
-  load(vkAcquireNextImageKHR);
   load(vkQueueSubmit);
-  load(vkQueuePresentKHR);
   load(vkQueueWaitIdle);
   load(vkDestroyShaderModule);
   load(vkDestroyRenderPass);
@@ -185,6 +263,36 @@ static int load_device_functions(struct render *r) {
   load(vkDestroySemaphore);
   load(vkCreateDescriptorSetLayout);
   load(vkDestroyDescriptorSetLayout);
+  load(vkCreateDescriptorPool);
+  load(vkDestroyDescriptorPool);
+  load(vkAllocateDescriptorSets);
+  load(vkUpdateDescriptorSets);
+  load(vkCreateFence);
+  load(vkDestroyFence);
+  load(vkWaitForFences);
+  load(vkResetFences);
+  load(vkDeviceWaitIdle);
+  load(vkResetCommandPool);
+  load(vkCmdCopyBuffer);
+  load(vkCmdPipelineBarrier);
+  load(vkCreatePipelineCache);
+  load(vkDestroyPipelineCache);
+  load(vkGetPipelineCacheData);
+  load(vkCreateImage);
+  load(vkDestroyImage);
+  load(vkGetImageMemoryRequirements);
+  load(vkBindImageMemory);
+  load(vkCreateQueryPool);
+  load(vkDestroyQueryPool);
+  load(vkGetQueryPoolResults);
+  load(vkCmdResetQueryPool);
+  load(vkCmdWriteTimestamp);
+  load(vkCmdExecuteCommands);
+  if (r->headless) return RENDER_ERROR_NONE;
+  load(vkCreateSwapchainKHR);
+  load(vkGetSwapchainImagesKHR);
+  load(vkAcquireNextImageKHR);
+  load(vkQueuePresentKHR);
   return RENDER_ERROR_NONE;
 
 #undef load
@@ -194,6 +302,7 @@ static int create_surface(struct render *r, struct window *w) {
   VkXcbSurfaceCreateInfoKHR create_info = { 0 };
   VkResult result;
 
+  if (r->headless) return RENDER_ERROR_NONE;
   create_info.sType = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
   create_info.connection = window_xcb_connection(w);
   create_info.window = window_xcb_window(w);
@@ -207,6 +316,14 @@ static int create_surface(struct render *r, struct window *w) {
   return RENDER_ERROR_NONE;
 }
 
+static void get_device_properties(struct render *r) {
+  VkPhysicalDevice phys = r->phys_devices[r->phys_id];
+
+  r->vkGetPhysicalDeviceProperties(phys, &r->phys_props);
+  r->vkGetPhysicalDeviceFeatures(phys, &r->phys_features);
+  r->vkGetPhysicalDeviceMemoryProperties(phys, &r->memory_props);
+}
+
 static int get_queue_props(struct render *r) {
   uint32_t n_props;
 
@@ -227,6 +344,11 @@ static int get_queue_props(struct render *r) {
   return RENDER_ERROR_NONE;
 }
 
+/**
+ * A family that both draws and presents is taken as soon as it turns up,
+ * which saves handing every image over to another queue. Otherwise the
+ * first of each is used
+ */
 static int get_queue_indices(struct render *r) {
   int graphics_isset = 0;
   int present_isset = 0;
@@ -235,21 +357,32 @@ static int get_queue_indices(struct render *r) {
 
   for (i = 0; i < r->n_queue_props; ++i) {
     uint32_t present_support = 0;
+    int graphics;
 
-    if (  (r->queue_props[i].queueCount > 0)
-       && (r->queue_props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
-       ) {
+    if (r->queue_props[i].queueCount == 0) continue;
+    graphics = (r->queue_props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+    if (r->headless) {
+      /* Nothing is presented, the graphics queue stands in */
+      present_support = 1;
+    } else {
+      result = r->vkGetPhysicalDeviceSurfaceSupportKHR(
+        r->phys_devices[r->phys_id],
+        (uint32_t) i,
+        r->surface,
+        &present_support
+      );
+      if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_QUEUE_INDICES;
+    }
+    if (graphics && present_support) {
+      r->queue_index_graphics = i;
+      r->queue_index_present = i;
+      return RENDER_ERROR_NONE;
+    }
+    if (graphics && !graphics_isset) {
       graphics_isset = 1;
       r->queue_index_graphics = i;
     }
-    result = r->vkGetPhysicalDeviceSurfaceSupportKHR(
-      r->phys_devices[r->phys_id],
-      (uint32_t) i,
-      r->surface,
-      &present_support
-    );
-    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_QUEUE_INDICES;
-    if ((r->queue_props[i].queueCount > 0) && present_support) {
+    if (present_support && !present_isset) {
       present_isset = 1;
       r->queue_index_present = i;
     }
@@ -258,31 +391,283 @@ static int get_queue_indices(struct render *r) {
   return RENDER_ERROR_VULKAN_QUEUE_INDICES;
 }
 
+/* Images have to change hands between rendering and presenting */
+static int separate_present(struct render *r) {
+  return !r->headless && r->queue_index_present != r->queue_index_graphics;
+}
+
+/**
+ * The release and acquire halves of handing a rendered image to the
+ * present family. Only the stage and access masks differ between them
+ */
+static void present_barrier(
+  struct render *r,
+  VkImage image,
+  VkImageMemoryBarrier *out
+) {
+  memset(out, 0, sizeof(VkImageMemoryBarrier));
+  out->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+  out->oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  out->newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  out->srcQueueFamilyIndex = (uint32_t) r->queue_index_graphics;
+  out->dstQueueFamilyIndex = (uint32_t) r->queue_index_present;
+  out->image = image;
+  out->subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  out->subresourceRange.levelCount = 1;
+  out->subresourceRange.layerCount = 1;
+}
+
+/**
+ * Looks for a family that transfers but can't draw. A transfer-only one
+ * is usually a DMA engine, so that beats one that also computes. Without
+ * either, uploads share the graphics queue
+ */
+static int get_transfer_queue_index(struct render *r) {
+  size_t i;
+
+  r->has_transfer_queue = 0;
+  r->queue_index_transfer = r->queue_index_graphics;
+  for (i = 0; i < r->n_queue_props; ++i) {
+    VkQueueFlags flags = r->queue_props[i].queueFlags;
+
+    if (r->queue_props[i].queueCount == 0) continue;
+    if (flags & VK_QUEUE_GRAPHICS_BIT) continue;
+    /* Compute families transfer whether or not they say so */
+    if (!(flags & (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_COMPUTE_BIT))) continue;
+    if (!r->has_transfer_queue || !(flags & VK_QUEUE_COMPUTE_BIT)) {
+      r->queue_index_transfer = i;
+      r->has_transfer_queue = 1;
+    }
+    if (!(flags & VK_QUEUE_COMPUTE_BIT)) break;
+  }
+  return RENDER_ERROR_NONE;
+}
+
+static int has_device_extension(
+  struct render *r,
+  size_t id,
+  const char *name
+) {
+  VkPhysicalDevice phys = r->phys_devices[id];
+  VkExtensionProperties *props;
+  uint32_t i, n_props;
+  int found = 0;
+  VkResult result;
+
+  result = r->vkEnumerateDeviceExtensionProperties(phys, NULL, &n_props, NULL);
+  if (result != VK_SUCCESS || n_props == 0) return 0;
+  props = malloc(sizeof(VkExtensionProperties) * n_props);
+  if (!props) return 0;
+  result = r->vkEnumerateDeviceExtensionProperties(phys, NULL, &n_props, props);
+  if (result == VK_SUCCESS) {
+    for (i = 0; i < n_props && !found; ++i) {
+      found = !strcmp(props[i].extensionName, name);
+    }
+  }
+  free(props);
+  return found;
+}
+
+static int device_has_present_queue(
+  struct render *r,
+  VkPhysicalDevice phys,
+  uint32_t n_props,
+  VkQueueFamilyProperties *props
+) {
+  uint32_t i;
+
+  for (i = 0; i < n_props; ++i) {
+    uint32_t present_support = 0;
+    VkResult result;
+
+    if (props[i].queueCount == 0) continue;
+    result = r->vkGetPhysicalDeviceSurfaceSupportKHR(
+      phys,
+      i,
+      r->surface,
+      &present_support
+    );
+    if (result == VK_SUCCESS && present_support) return 1;
+  }
+  return 0;
+}
+
+/**
+ * Scores physical device id, 0 meaning it can't be used at all. It needs a
+ * graphics queue and, unless headless, a queue that presents to the
+ * surface and VK_KHR_swapchain. Past that a discrete GPU beats an
+ * integrated one beats the rest, and more device local memory breaks ties
+ */
+static int score_device(
+  struct render *r,
+  size_t id,
+  struct render_device_info *out
+) {
+  VkPhysicalDevice phys = r->phys_devices[id];
+  VkPhysicalDeviceProperties props;
+  VkPhysicalDeviceMemoryProperties memory_props;
+  VkQueueFamilyProperties *queue_props;
+  uint32_t i, n_queue_props;
+  int has_graphics = 0, usable;
+  uint64_t type_rank;
+
+  memset(out, 0, sizeof(struct render_device_info));
+  out->index = id;
+  r->vkGetPhysicalDeviceProperties(phys, &props);
+  memcpy(out->name, props.deviceName, VK_MAX_PHYSICAL_DEVICE_NAME_SIZE);
+  out->name[VK_MAX_PHYSICAL_DEVICE_NAME_SIZE - 1] = '\0';
+  out->type = props.deviceType;
+  if (  r->vkGetPhysicalDeviceProperties2
+     && props.apiVersion >= VK_API_VERSION_1_1
+     ) {
+    VkPhysicalDeviceProperties2 props2 = { 0 };
+    VkPhysicalDeviceIDProperties id_props = { 0 };
+
+    id_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+    props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    props2.pNext = &id_props;
+    r->vkGetPhysicalDeviceProperties2(phys, &props2);
+    memcpy(out->uuid, id_props.deviceUUID, VK_UUID_SIZE);
+  }
+  r->vkGetPhysicalDeviceMemoryProperties(phys, &memory_props);
+  for (i = 0; i < memory_props.memoryHeapCount; ++i) {
+    if (memory_props.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+      out->vram += memory_props.memoryHeaps[i].size;
+    }
+  }
+  r->vkGetPhysicalDeviceQueueFamilyProperties(phys, &n_queue_props, NULL);
+  if (n_queue_props == 0) return RENDER_ERROR_NONE;
+  queue_props = malloc(sizeof(VkQueueFamilyProperties) * n_queue_props);
+  if (!queue_props) return RENDER_ERROR_MEMORY;
+  r->vkGetPhysicalDeviceQueueFamilyProperties(
+    phys,
+    &n_queue_props,
+    queue_props
+  );
+  for (i = 0; i < n_queue_props; ++i) {
+    if (  queue_props[i].queueCount > 0
+       && (queue_props[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
+       ) {
+      has_graphics = 1;
+    }
+  }
+  usable = has_graphics;
+  if (usable && !r->headless) {
+    usable = device_has_present_queue(r, phys, n_queue_props, queue_props)
+          && has_device_extension(r, id, "VK_KHR_swapchain");
+  }
+  free(queue_props);
+  if (!usable) return RENDER_ERROR_NONE;
+  switch (props.deviceType) {
+  case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU:   type_rank = 4; break;
+  case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: type_rank = 3; break;
+  case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU:    type_rank = 2; break;
+  case VK_PHYSICAL_DEVICE_TYPE_CPU:            type_rank = 0; break;
+  default:                                     type_rank = 1; break;
+  }
+  /* Type in the high bits, then device local MiB, never 0 once usable */
+  out->score = (type_rank << 48)
+             + ((out->vram >> 20) & (((uint64_t) 1 << 47) - 1))
+             + 1;
+  return RENDER_ERROR_NONE;
+}
+
+static int device_matches(struct render *r, struct render_device_info *info) {
+  if (r->wanted_device_name && !strstr(info->name, r->wanted_device_name)) {
+    return 0;
+  }
+  if (  r->has_wanted_uuid
+     && memcmp(info->uuid, r->wanted_device_uuid, VK_UUID_SIZE)
+     ) {
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Picks the best scoring usable device, or the best one matching the
+ * render_set_device() override when there is one
+ */
+static int select_device(struct render *r) {
+  struct render_device_info info, best;
+  int wanted = r->wanted_device_name || r->has_wanted_uuid;
+  int found = 0;
+  size_t i;
+
+  memset(&best, 0, sizeof(struct render_device_info));
+  for (i = 0; i < r->n_devices; ++i) {
+    chkerr(score_device(r, i, &info));
+    if (!info.score) continue;
+    if (wanted && !device_matches(r, &info)) continue;
+    if (!found || info.score > best.score) {
+      best = info;
+      found = 1;
+    }
+  }
+  if (!found) {
+    if (wanted) return RENDER_ERROR_DEVICE_NOT_FOUND;
+    return RENDER_ERROR_VULKAN_NO_DEVICES;
+  }
+  best.overridden = wanted;
+  r->device_info = best;
+  r->phys_id = best.index;
+  return RENDER_ERROR_NONE;
+}
+
 static int create_device(struct render *r) {
-  char *extensions[] = { "VK_KHR_swapchain" };
-  float queue_priority = 1.0f;
-  VkDeviceQueueCreateInfo queue_create_infos[] = { { 0 }, { 0 } };
+  char *extensions[] = { NULL, NULL };
+  uint32_t n_extensions = 0;
+  float queue_priorities[] = { 1.0f, 1.0f };
+  VkDeviceQueueCreateInfo queue_create_infos[] = { { 0 }, { 0 }, { 0 } };
+  size_t families[3], counts[3];
+  size_t i, n_families = 0, transfer_slot = 0;
+  VkPhysicalDeviceFeatures features = { 0 };
   VkDeviceCreateInfo create_info = { 0 };
   VkResult result;
 
-  /* TODO: support separate graphics and present queues */
-  /* currently this is out of spec */
+  /* Each distinct family once, the spec allows nothing else */
+  families[n_families] = r->queue_index_graphics;
+  counts[n_families++] = 1;
   if (r->queue_index_present != r->queue_index_graphics) {
-    return RENDER_ERROR_VULKAN_QUEUE_INDEX_MISMATCH;
-  }
-  queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queue_create_infos[0].queueFamilyIndex = (uint32_t) r->queue_index_graphics;
-  queue_create_infos[0].queueCount = 1;
-  queue_create_infos[0].pQueuePriorities = &queue_priority;
-  queue_create_infos[1].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-  queue_create_infos[1].queueFamilyIndex = (uint32_t) r->queue_index_present;
-  queue_create_infos[1].queueCount = 1;
-  queue_create_infos[1].pQueuePriorities = &queue_priority;
+    families[n_families] = r->queue_index_present;
+    counts[n_families++] = 1;
+  }
+  if (r->has_transfer_queue) {
+    for (i = 0; i < n_families; ++i) {
+      if (families[i] == r->queue_index_transfer) break;
+    }
+    if (i == n_families) {
+      families[n_families] = r->queue_index_transfer;
+      counts[n_families++] = 0;
+    }
+    /* A family that also presents shares its queue if it has only one */
+    if (counts[i] < r->queue_props[r->queue_index_transfer].queueCount) {
+      transfer_slot = counts[i]++;
+    }
+  }
+  for (i = 0; i < n_families; ++i) {
+    VkDeviceQueueCreateInfo *info = queue_create_infos + i;
+
+    info->sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    info->queueFamilyIndex = (uint32_t) families[i];
+    info->queueCount = (uint32_t) counts[i];
+    info->pQueuePriorities = queue_priorities;
+  }
   create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-  create_info.queueCreateInfoCount = 1;
+  create_info.queueCreateInfoCount = (uint32_t) n_families;
   create_info.pQueueCreateInfos = queue_create_infos;
-  create_info.enabledExtensionCount = 1;
+  if (!r->headless) extensions[n_extensions++] = "VK_KHR_swapchain";
+  /* Optional, only used to report pipeline cache hits */
+  r->has_creation_feedback =
+    has_device_extension(r, r->phys_id, "VK_EXT_pipeline_creation_feedback");
+  if (r->has_creation_feedback) {
+    extensions[n_extensions++] = "VK_EXT_pipeline_creation_feedback";
+  }
+  create_info.enabledExtensionCount = n_extensions;
   create_info.ppEnabledExtensionNames = (const char * const *) extensions;
+  /* Lets indirect batches go out as a single draw call */
+  features.multiDrawIndirect = r->phys_features.multiDrawIndirect;
+  create_info.pEnabledFeatures = &features;
   result = r->vkCreateDevice(
     r->phys_devices[r->phys_id],
     &create_info,
@@ -302,14 +687,33 @@ static int create_device(struct render *r) {
     0,
     &r->present_queue
   );
+  r->vkGetDeviceQueue(
+    r->device,
+    (uint32_t) r->queue_index_transfer,
+    (uint32_t) transfer_slot,
+    &r->transfer_queue
+  );
   return RENDER_ERROR_NONE;
 }
 
+/* Along with the queue properties it was created from */
+static void destroy_device(struct render *r) {
+  r->vkDestroyDevice(r->device, NULL);
+  r->device = VK_NULL_HANDLE;
+  free(r->queue_props);
+  r->queue_props = NULL;
+}
+
 static int get_surface_format(struct render *r) {
   uint32_t n_formats;
   VkSurfaceFormatKHR *formats;
   VkResult result;
 
+  if (r->headless) {
+    r->format.format = VK_FORMAT_B8G8R8A8_UNORM;
+    r->format.colorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+    return RENDER_ERROR_NONE;
+  }
   result = r->vkGetPhysicalDeviceSurfaceFormatsKHR(
     r->phys_devices[r->phys_id],
     r->surface,
@@ -377,38 +781,173 @@ static int get_swapchain_images(struct render *r) {
   return RENDER_ERROR_NONE;
 }
 
+/**
+ * Picks the wanted mode if the surface has it, otherwise the closest one
+ * in spirit. FIFO is always supported so every chain ends there
+ */
+static int choose_present_mode(struct render *r, VkPresentModeKHR *out) {
+  VkPresentModeKHR mailbox[] = {
+    VK_PRESENT_MODE_MAILBOX_KHR,
+    VK_PRESENT_MODE_IMMEDIATE_KHR,
+    VK_PRESENT_MODE_FIFO_KHR
+  };
+  VkPresentModeKHR immediate[] = {
+    VK_PRESENT_MODE_IMMEDIATE_KHR,
+    VK_PRESENT_MODE_MAILBOX_KHR,
+    VK_PRESENT_MODE_FIFO_KHR
+  };
+  VkPresentModeKHR relaxed[] = {
+    VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+    VK_PRESENT_MODE_FIFO_KHR
+  };
+  VkPresentModeKHR fifo[] = { VK_PRESENT_MODE_FIFO_KHR };
+  VkPresentModeKHR *chain, *modes;
+  size_t n_chain, i;
+  uint32_t j, n_modes;
+  VkResult result;
+
+  switch (r->wanted_present_mode) {
+  case VK_PRESENT_MODE_MAILBOX_KHR:
+    chain = mailbox;
+    n_chain = sizeof(mailbox) / sizeof(mailbox[0]);
+    break;
+  case VK_PRESENT_MODE_IMMEDIATE_KHR:
+    chain = immediate;
+    n_chain = sizeof(immediate) / sizeof(immediate[0]);
+    break;
+  case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+    chain = relaxed;
+    n_chain = sizeof(relaxed) / sizeof(relaxed[0]);
+    break;
+  default:
+    chain = fifo;
+    n_chain = 1;
+    break;
+  }
+  *out = VK_PRESENT_MODE_FIFO_KHR;
+  if (n_chain == 1) return RENDER_ERROR_NONE;
+  result = r->vkGetPhysicalDeviceSurfacePresentModesKHR(
+    r->phys_devices[r->phys_id],
+    r->surface,
+    &n_modes,
+    NULL
+  );
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SURFACE_CAPABILITIES;
+  if (n_modes == 0) return RENDER_ERROR_NONE;
+  modes = malloc(sizeof(VkPresentModeKHR) * n_modes);
+  if (!modes) return RENDER_ERROR_MEMORY;
+  result = r->vkGetPhysicalDeviceSurfacePresentModesKHR(
+    r->phys_devices[r->phys_id],
+    r->surface,
+    &n_modes,
+    modes
+  );
+  if (result != VK_SUCCESS) {
+    free(modes);
+    return RENDER_ERROR_VULKAN_SURFACE_CAPABILITIES;
+  }
+  for (i = 0; i < n_chain; ++i) {
+    for (j = 0; j < n_modes; ++j) {
+      if (modes[j] == chain[i]) break;
+    }
+    if (j < n_modes) {
+      *out = chain[i];
+      break;
+    }
+  }
+  free(modes);
+  return RENDER_ERROR_NONE;
+}
+
+static uint32_t choose_image_count(
+  struct render *r,
+  VkSurfaceCapabilitiesKHR *caps
+) {
+  uint32_t n = (uint32_t) r->wanted_image_count;
+
+  if (n < caps->minImageCount) n = caps->minImageCount;
+  /* A max of zero means there is no upper limit */
+  if (caps->maxImageCount && n > caps->maxImageCount) {
+    n = caps->maxImageCount;
+  }
+  return n;
+}
+
+static VkExtent2D choose_extent(
+  struct render *r,
+  VkSurfaceCapabilitiesKHR *caps
+) {
+  VkExtent2D extent = caps->currentExtent;
+
+  /* The surface lets us pick, so go with what was asked for */
+  if (extent.width == 0xFFFFFFFF) {
+    extent = r->requested_extent;
+    if (extent.width < caps->minImageExtent.width) {
+      extent.width = caps->minImageExtent.width;
+    }
+    if (extent.width > caps->maxImageExtent.width) {
+      extent.width = caps->maxImageExtent.width;
+    }
+    if (extent.height < caps->minImageExtent.height) {
+      extent.height = caps->minImageExtent.height;
+    }
+    if (extent.height > caps->maxImageExtent.height) {
+      extent.height = caps->maxImageExtent.height;
+    }
+  }
+  return extent;
+}
+
 static int create_swapchain(struct render *r) {
   VkSwapchainCreateInfoKHR create_info = { 0 };
   VkSurfaceCapabilitiesKHR caps;
+  VkSwapchainKHR old_swapchain = r->swapchain;
+  VkPresentModeKHR present_mode;
   VkResult result;
 
   chkerr(get_surface_caps(r, &caps));
+  chkerr(choose_present_mode(r, &present_mode));
+  r->swap_extent = choose_extent(r, &caps);
+  /* Minimized, nothing can be presented until the window comes back */
+  if (r->swap_extent.width == 0 || r->swap_extent.height == 0) {
+    r->swapchain_dirty = 1;
+    return RENDER_ERROR_NONE;
+  }
   create_info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
   create_info.surface = r->surface;
-  create_info.minImageCount = 2;
+  create_info.minImageCount = choose_image_count(r, &caps);
   create_info.imageFormat = r->format.format;
   create_info.imageColorSpace = r->format.colorSpace;
-  create_info.imageExtent = caps.currentExtent;
+  create_info.imageExtent = r->swap_extent;
   create_info.imageArrayLayers = 1;
   create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
   create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
   create_info.preTransform = caps.currentTransform;
   create_info.compositeAlpha = caps.supportedCompositeAlpha;
-  create_info.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+  create_info.presentMode = present_mode;
   create_info.clipped = VK_TRUE;
+  create_info.oldSwapchain = old_swapchain;
   result = r->vkCreateSwapchainKHR(
     r->device,
     &create_info,
     NULL,
     &r->swapchain
   );
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SWAPCHAIN;
-  r->swap_extent = caps.currentExtent;
+  if (old_swapchain) {
+    r->vkDestroySwapchainKHR(r->device, old_swapchain, NULL);
+  }
+  if (result != VK_SUCCESS) {
+    r->swapchain = VK_NULL_HANDLE;
+    return RENDER_ERROR_VULKAN_SWAPCHAIN;
+  }
+  r->swapchain_dirty = 0;
+  r->present_mode = present_mode;
+  /* The driver may hand back more images than minImageCount */
   chkerr(get_swapchain_images(r));
   return RENDER_ERROR_NONE;
 }
 
-static int read_shader(char *filename, size_t *out_len, unsigned char **out) {
+static int read_file(char *filename, size_t *out_len, unsigned char **out) {
   unsigned char *buf;
   long size;
   size_t read;
@@ -418,18 +957,154 @@ static int read_shader(char *filename, size_t *out_len, unsigned char **out) {
   if (!f) return RENDER_ERROR_FILE;
   fseek(f, 0, SEEK_END);
   size = ftell(f);
-  if (size % 4) return RENDER_ERROR_VULKAN_SHADER_READ;
-  buf = malloc((size_t) size);
-  if (!buf) return RENDER_ERROR_MEMORY;
+  if (size < 0) {
+    fclose(f);
+    return RENDER_ERROR_FILE;
+  }
+  buf = malloc(size ? (size_t) size : 1);
+  if (!buf) {
+    fclose(f);
+    return RENDER_ERROR_MEMORY;
+  }
   fseek(f, 0, SEEK_SET);
   read = fread(buf, 1, (size_t) size, f);
-  if (read != size) return RENDER_ERROR_FILE;
+  fclose(f);
+  if (read != (size_t) size) {
+    free(buf);
+    return RENDER_ERROR_FILE;
+  }
   *out = buf;
   *out_len = (size_t) size;
-  fclose(f);
   return RENDER_ERROR_NONE;
 }
 
+static int read_shader(char *filename, size_t *out_len, unsigned char **out) {
+  chkerr(read_file(filename, out_len, out));
+  if (*out_len % 4) {
+    free(*out);
+    return RENDER_ERROR_VULKAN_SHADER_READ;
+  }
+  return RENDER_ERROR_NONE;
+}
+
+/* Rejects cache data written by a different driver or device */
+static int valid_cache_header(
+  struct render *r,
+  unsigned char *data,
+  size_t len
+) {
+  uint32_t header_size, header_version, vendor_id, device_id;
+
+  if (len < 16 + VK_UUID_SIZE) return 0;
+  memcpy(&header_size, data, 4);
+  memcpy(&header_version, data + 4, 4);
+  memcpy(&vendor_id, data + 8, 4);
+  memcpy(&device_id, data + 12, 4);
+  if (header_size < 16 + VK_UUID_SIZE || header_size > len) return 0;
+  if (header_version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE) return 0;
+  if (vendor_id != r->phys_props.vendorID) return 0;
+  if (device_id != r->phys_props.deviceID) return 0;
+  return !memcmp(data + 16, r->phys_props.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+static int create_pipeline_cache(struct render *r) {
+  VkPipelineCacheCreateInfo create_info = { 0 };
+  unsigned char *data = NULL;
+  size_t len = 0;
+  VkResult result;
+
+  memset(&r->pipeline_cache_stats, 0, sizeof(r->pipeline_cache_stats));
+  /* A missing or stale file just means starting with an empty cache */
+  if (  r->pipeline_cache_path
+     && read_file(r->pipeline_cache_path, &len, &data) == RENDER_ERROR_NONE
+     && !valid_cache_header(r, data, len)
+     ) {
+    free(data);
+    data = NULL;
+    len = 0;
+  }
+  create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  create_info.initialDataSize = len;
+  create_info.pInitialData = data;
+  result = r->vkCreatePipelineCache(
+    r->device,
+    &create_info,
+    NULL,
+    &r->pipeline_cache
+  );
+  free(data);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_PIPELINE_CACHE;
+  r->pipeline_cache_stats.loaded = len > 0;
+  return RENDER_ERROR_NONE;
+}
+
+static int save_pipeline_cache(struct render *r) {
+  unsigned char *data;
+  char *tmp_path;
+  size_t len, written;
+  VkResult result;
+  FILE *f;
+
+  if (!r->pipeline_cache_path || !r->pipeline_cache) {
+    return RENDER_ERROR_NONE;
+  }
+  result = r->vkGetPipelineCacheData(
+    r->device,
+    r->pipeline_cache,
+    &len,
+    NULL
+  );
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_PIPELINE_CACHE;
+  data = malloc(len ? len : 1);
+  if (!data) return RENDER_ERROR_MEMORY;
+  result = r->vkGetPipelineCacheData(
+    r->device,
+    r->pipeline_cache,
+    &len,
+    data
+  );
+  if (result != VK_SUCCESS) {
+    free(data);
+    return RENDER_ERROR_VULKAN_PIPELINE_CACHE;
+  }
+  /* Write beside the old file and swap so a crash never leaves half */
+  tmp_path = malloc(strlen(r->pipeline_cache_path) + 5);
+  if (!tmp_path) {
+    free(data);
+    return RENDER_ERROR_MEMORY;
+  }
+  strcpy(tmp_path, r->pipeline_cache_path);
+  strcat(tmp_path, ".tmp");
+  f = fopen(tmp_path, "wb");
+  if (!f) {
+    free(tmp_path);
+    free(data);
+    return RENDER_ERROR_FILE;
+  }
+  written = fwrite(data, 1, len, f);
+  free(data);
+  if (fclose(f) != 0 || written != len) {
+    remove(tmp_path);
+    free(tmp_path);
+    return RENDER_ERROR_FILE;
+  }
+  /* rename() replaces the old file in one step on POSIX */
+  if (rename(tmp_path, r->pipeline_cache_path) != 0) {
+    remove(tmp_path);
+    free(tmp_path);
+    return RENDER_ERROR_FILE;
+  }
+  free(tmp_path);
+  return RENDER_ERROR_NONE;
+}
+
+static void destroy_pipeline_cache(struct render *r) {
+  if (!r->pipeline_cache) return;
+  save_pipeline_cache(r);
+  r->vkDestroyPipelineCache(r->device, r->pipeline_cache, NULL);
+  r->pipeline_cache = VK_NULL_HANDLE;
+}
+
 static int create_shader(
   struct render *r,
   unsigned char *source,
@@ -458,9 +1133,11 @@ static int create_descriptor_set_layout(struct render *r) {
   VkResult result;
 
   layout_binding.binding = 0;
-  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  layout_binding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   layout_binding.descriptorCount = 1;
-  layout_binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+  layout_binding.stageFlags = ( VK_SHADER_STAGE_VERTEX_BIT
+                              | VK_SHADER_STAGE_FRAGMENT_BIT
+                              );
   descriptor_layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
   descriptor_layout_info.bindingCount = 1;
   descriptor_layout_info.pBindings = &layout_binding;
@@ -476,15 +1153,29 @@ static int create_descriptor_set_layout(struct render *r) {
 
 static int create_pipeline_layout(
   struct render *r,
+  uint32_t push_constant_size,
   VkPipelineLayout *out_layout
 ) {
   VkResult result;
+  VkPushConstantRange push_range = { 0 };
   VkPipelineLayoutCreateInfo create_info = { 0 };
 
-  /* chkerr(create_descriptor_set_layout(r)); */
+  /**
+   * Every pipeline shares the set, so it stays bound across switches
+   * between pipelines with the same push constant range
+   */
   create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-  /* create_info.setLayoutCount = 1; */
-  /* create_info.pSetLayouts = &r->descriptor_set_layout; */
+  create_info.setLayoutCount = 1;
+  create_info.pSetLayouts = &r->descriptor_set_layout;
+  if (push_constant_size) {
+    push_range.stageFlags = ( VK_SHADER_STAGE_VERTEX_BIT
+                            | VK_SHADER_STAGE_FRAGMENT_BIT
+                            );
+    push_range.offset = 0;
+    push_range.size = push_constant_size;
+    create_info.pushConstantRangeCount = 1;
+    create_info.pPushConstantRanges = &push_range;
+  }
   result = r->vkCreatePipelineLayout(
     r->device,
     &create_info,
@@ -522,7 +1213,10 @@ static int create_render_pass(struct render *r) {
   attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  /* Offscreen targets are left ready to be copied out */
+  attachment.finalLayout = r->headless
+    ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+    : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
   subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
   subpass.colorAttachmentCount = 1;
   subpass.pColorAttachments = &attachment_ref;
@@ -543,29 +1237,58 @@ static int create_render_pass(struct render *r) {
   return RENDER_ERROR_NONE;
 }
 
-static int create_pipeline(
-  struct render *r,
-  size_t n_bindings,
-  VkVertexInputBindingDescription *bindings,
-  size_t n_attrs,
-  VkVertexInputAttributeDescription *attrs,
-  char *vshader,
-  char *fshader
+/* Interleaved vec3 position, vec3 color */
+static VkVertexInputBindingDescription default_bindings[] = {
+  { 0, sizeof(float) * 6, VK_VERTEX_INPUT_RATE_VERTEX }
+};
+static VkVertexInputAttributeDescription default_attrs[] = {
+  { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 },
+  { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, sizeof(float) * 3 }
+};
+
+/* The mesh layout, plus the instance stream if the info declares one */
+static void set_vertex_input(
+  struct render_pipeline_desc *d,
+  struct render_pipeline_info *info
 ) {
-  unsigned char *vert_shader, *frag_shader;
-  size_t vlen, flen;
+  VkVertexInputBindingDescription *binding;
+  size_t i;
 
-  VkShaderModule vert_module, frag_module;
+  memcpy(d->bindings, default_bindings, sizeof(default_bindings));
+  memcpy(d->attrs, default_attrs, sizeof(default_attrs));
+  d->n_bindings = sizeof(default_bindings) / sizeof(default_bindings[0]);
+  d->n_attrs = sizeof(default_attrs) / sizeof(default_attrs[0]);
+  if (!info->instance_stride) return;
+  binding = d->bindings + d->n_bindings++;
+  binding->binding = RENDER_INSTANCE_BINDING;
+  binding->stride = (uint32_t) info->instance_stride;
+  binding->inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+  for (i = 0; i < info->n_instance_attrs; ++i) {
+    VkVertexInputAttributeDescription *attr = d->attrs + d->n_attrs++;
+
+    attr->location = (uint32_t) (RENDER_INSTANCE_LOCATION + i);
+    attr->binding = RENDER_INSTANCE_BINDING;
+    attr->format = info->instance_attrs[i].format;
+    attr->offset = info->instance_attrs[i].offset;
+  }
+}
 
+/**
+ * Builds out->pipeline from its description. Touches nothing in r but
+ * what stays put until the compiler is drained, so compile threads can
+ * run it too. The creation feedback flags go to *out_feedback
+ */
+static int build_pipeline(
+  struct render *r,
+  struct render_pipeline *out,
+  VkPipelineCreationFeedbackFlagsEXT *out_feedback
+) {
   VkPipelineShaderStageCreateInfo shader_info[] = { { 0 }, { 0 } };
 
   VkPipelineVertexInputStateCreateInfo vertex_info = { 0 };
 
   VkPipelineInputAssemblyStateCreateInfo assembly_info = { 0 };
 
-  VkViewport viewport = { 0 };
-  VkRect2D scissor = { 0 };
-
   VkPipelineViewportStateCreateInfo viewport_info = { 0 };
 
   VkPipelineRasterizationStateCreateInfo raster_info = { 0 };
@@ -578,65 +1301,68 @@ static int create_pipeline(
 
   VkPipelineColorBlendStateCreateInfo color_info = { 0 };
 
+  VkDynamicState dynamic_states[] = {
+    VK_DYNAMIC_STATE_VIEWPORT,
+    VK_DYNAMIC_STATE_SCISSOR
+  };
   VkPipelineDynamicStateCreateInfo dynamic_info = { 0 };
 
-  VkPipelineLayout layout;
-
   VkGraphicsPipelineCreateInfo graphics_pipeline = { 0 };
 
+  VkPipelineCreationFeedbackCreateInfoEXT feedback_info = { 0 };
+  VkPipelineCreationFeedbackEXT feedback = { 0 };
+  VkPipelineCreationFeedbackEXT stage_feedback[2];
+
   VkResult result;
 
-  chkerr(read_shader(vshader, &vlen, &vert_shader));
-  chkerr(read_shader(fshader, &flen, &frag_shader));
-  chkerr(create_shader(r, vert_shader, vlen, &vert_module));
-  chkerr(create_shader(r, frag_shader, flen, &frag_module));
-  free(vert_shader);
-  free(frag_shader);
   shader_info[0].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   shader_info[0].stage = VK_SHADER_STAGE_VERTEX_BIT;
-  shader_info[0].module = vert_module;
+  shader_info[0].module = out->desc.vert_module;
   shader_info[0].pName = "main";
   shader_info[1].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
   shader_info[1].stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  shader_info[1].module = frag_module;
+  shader_info[1].module = out->desc.frag_module;
   shader_info[1].pName = "main";
 
   vertex_info.sType =
     VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-  vertex_info.vertexBindingDescriptionCount = (uint32_t) n_bindings;
-  vertex_info.pVertexBindingDescriptions = bindings;
-  vertex_info.vertexAttributeDescriptionCount = (uint32_t) n_attrs;
-  vertex_info.pVertexAttributeDescriptions = attrs;
+  vertex_info.vertexBindingDescriptionCount = out->desc.n_bindings;
+  vertex_info.pVertexBindingDescriptions = out->desc.bindings;
+  vertex_info.vertexAttributeDescriptionCount = out->desc.n_attrs;
+  vertex_info.pVertexAttributeDescriptions = out->desc.attrs;
 
   assembly_info.sType =
     VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  switch (out->desc.topology) {
+  case RENDER_TOPOLOGY_TRIANGLE_STRIP:
+    assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+    break;
+  case RENDER_TOPOLOGY_LINES:
+    assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+    break;
+  case RENDER_TOPOLOGY_POINTS:
+    assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+    break;
+  default:
+    assembly_info.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+  }
   assembly_info.primitiveRestartEnable = VK_FALSE;
 
-  viewport.x = 0.0f;
-  viewport.y = 0.0f;
-  viewport.width = (float) r->swap_extent.width;
-  viewport.height = (float) r->swap_extent.height;
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
-
-  scissor.offset.x = 0;
-  scissor.offset.y = 0;
-  scissor.extent.width = r->swap_extent.width;
-  scissor.extent.height = r->swap_extent.height;
-
+  /* Both are set while recording, see record_viewport() */
   viewport_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
   viewport_info.viewportCount = 1;
-  viewport_info.pViewports = &viewport;
   viewport_info.scissorCount = 1;
-  viewport_info.pScissors = &scissor;
 
   raster_info.sType =
     VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
   raster_info.depthClampEnable = VK_FALSE;
   raster_info.rasterizerDiscardEnable = VK_FALSE;
   raster_info.polygonMode = VK_POLYGON_MODE_FILL;
-  raster_info.cullMode = VK_CULL_MODE_BACK_BIT;
+  switch (out->desc.cull) {
+  case RENDER_CULL_NONE:  raster_info.cullMode = VK_CULL_MODE_NONE; break;
+  case RENDER_CULL_FRONT: raster_info.cullMode = VK_CULL_MODE_FRONT_BIT; break;
+  default:                raster_info.cullMode = VK_CULL_MODE_BACK_BIT;
+  }
   raster_info.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
   raster_info.depthBiasEnable = VK_FALSE;
   raster_info.lineWidth = 1.0;
@@ -657,7 +1383,17 @@ static int create_pipeline(
   depth_info.depthBoundsTestEnable = VK_FALSE;
   depth_info.stencilTestEnable = VK_FALSE;
 
-  color_attachment.blendEnable = VK_FALSE;
+  color_attachment.blendEnable = out->desc.blend != RENDER_BLEND_NONE;
+  color_attachment.srcColorBlendFactor = out->desc.blend == RENDER_BLEND_ALPHA
+    ? VK_BLEND_FACTOR_SRC_ALPHA
+    : VK_BLEND_FACTOR_ONE;
+  color_attachment.dstColorBlendFactor = out->desc.blend == RENDER_BLEND_ALPHA
+    ? VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA
+    : VK_BLEND_FACTOR_ONE;
+  color_attachment.colorBlendOp = VK_BLEND_OP_ADD;
+  color_attachment.srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE;
+  color_attachment.dstAlphaBlendFactor = VK_BLEND_FACTOR_ZERO;
+  color_attachment.alphaBlendOp = VK_BLEND_OP_ADD;
   color_attachment.colorWriteMask = ( VK_COLOR_COMPONENT_R_BIT
                                     | VK_COLOR_COMPONENT_G_BIT
                                     | VK_COLOR_COMPONENT_B_BIT
@@ -669,10 +1405,9 @@ static int create_pipeline(
   color_info.pAttachments = &color_attachment;
 
   dynamic_info.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-  dynamic_info.dynamicStateCount = 0;
-
-  chkerr(create_pipeline_layout(r, &layout));
-  chkerr(create_render_pass(r));
+  dynamic_info.dynamicStateCount =
+    sizeof(dynamic_states) / sizeof(dynamic_states[0]);
+  dynamic_info.pDynamicStates = dynamic_states;
 
   graphics_pipeline.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
   graphics_pipeline.stageCount = sizeof(shader_info) / sizeof(shader_info[0]);
@@ -685,28 +1420,59 @@ static int create_pipeline(
   graphics_pipeline.pDepthStencilState = &depth_info;
   graphics_pipeline.pColorBlendState = &color_info;
   graphics_pipeline.pDynamicState = &dynamic_info;
-  graphics_pipeline.layout = layout;
+  graphics_pipeline.layout = out->layout;
   graphics_pipeline.renderPass = r->render_pass;
   graphics_pipeline.subpass = 0;
   graphics_pipeline.basePipelineHandle = VK_NULL_HANDLE;
   graphics_pipeline.basePipelineIndex = -1;
 
+  if (r->has_creation_feedback) {
+    memset(stage_feedback, 0, sizeof(stage_feedback));
+    feedback_info.sType =
+      VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+    feedback_info.pPipelineCreationFeedback = &feedback;
+    feedback_info.pipelineStageCreationFeedbackCount = 2;
+    feedback_info.pPipelineStageCreationFeedbacks = stage_feedback;
+    graphics_pipeline.pNext = &feedback_info;
+  }
+
   result = r->vkCreateGraphicsPipelines(
     r->device,
-    VK_NULL_HANDLE,
+    r->pipeline_cache,
     1,
     &graphics_pipeline,
     NULL,
-    &r->pipeline
+    &out->pipeline
   );
+  *out_feedback = feedback.flags;
   if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_CREATE_PIPELINE;
-  r->vkDestroyPipelineLayout(r->device, layout, NULL);
-  r->vkDestroyShaderModule(r->device, vert_module, NULL);
-  r->vkDestroyShaderModule(r->device, frag_module, NULL);
-
   return 0;
 }
 
+static void count_pipeline(
+  struct render *r,
+  VkPipelineCreationFeedbackFlagsEXT feedback
+) {
+  ++r->pipeline_cache_stats.n_pipelines;
+  if (feedback & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) {
+    if (  feedback
+        & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT
+       ) {
+      ++r->pipeline_cache_stats.n_hits;
+    } else {
+      ++r->pipeline_cache_stats.n_misses;
+    }
+  }
+}
+
+static int create_pipeline(struct render *r, struct render_pipeline *out) {
+  VkPipelineCreationFeedbackFlagsEXT feedback = 0;
+
+  chkerr(build_pipeline(r, out, &feedback));
+  count_pipeline(r, feedback);
+  return RENDER_ERROR_NONE;
+}
+
 static int create_image_view(
   struct render *r,
   size_t swapchain_index,
@@ -736,13 +1502,15 @@ static int create_image_view(
 static int create_framebuffers(struct render *r) {
   size_t i;
 
-  r->image_views = malloc(sizeof(VkImageView) * r->n_swapchain_images);
+  if (r->n_swapchain_images == 0) return RENDER_ERROR_NONE;
+  /* Zeroed so a partial failure can be torn down by destroy_framebuffers */
+  r->image_views = calloc(r->n_swapchain_images, sizeof(VkImageView));
   if (!r->image_views) return RENDER_ERROR_MEMORY;
   for (i = 0; i < r->n_swapchain_images; ++i) {
     /* &r->image_views[i] */
     chkerr(create_image_view(r, i, r->image_views + i));
   }
-  r->framebuffers = malloc(sizeof(VkFramebuffer) * r->n_swapchain_images);
+  r->framebuffers = calloc(r->n_swapchain_images, sizeof(VkFramebuffer));
   if (!r->framebuffers) return RENDER_ERROR_MEMORY;
   for (i = 0; i < r->n_swapchain_images; ++i) {
     VkFramebufferCreateInfo create_info = { 0 };
@@ -764,11 +1532,30 @@ static int create_framebuffers(struct render *r) {
   return RENDER_ERROR_NONE;
 }
 
+static void destroy_framebuffers(struct render *r) {
+  size_t i;
+
+  for (i = 0; i < r->n_swapchain_images; ++i) {
+    if (r->framebuffers) {
+      r->vkDestroyFramebuffer(r->device, r->framebuffers[i], NULL);
+    }
+    if (r->image_views) {
+      r->vkDestroyImageView(r->device, r->image_views[i], NULL);
+    }
+  }
+  free(r->framebuffers);
+  free(r->image_views);
+  r->framebuffers = NULL;
+  r->image_views = NULL;
+}
+
 static int create_command_pool(struct render *r) {
   VkCommandPoolCreateInfo create_info = { 0 };
   VkResult result;
 
   create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  /* Static buffers are re-recorded one image at a time */
+  create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
   create_info.queueFamilyIndex = (uint32_t) r->queue_index_graphics;
   result = r->vkCreateCommandPool(
     r->device,
@@ -780,12 +1567,62 @@ static int create_command_pool(struct render *r) {
   return RENDER_ERROR_NONE;
 }
 
+/**
+ * Each frame gets a pool of its own holding its primary buffer. Resetting
+ * the pool once the frame's fence signals is cheaper than resetting the
+ * buffer, and the driver can recycle the pool's memory wholesale
+ */
 static int create_command_buffers(struct render *r) {
+  VkCommandPoolCreateInfo create_info = { 0 };
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  size_t i;
+  VkResult result;
+
+  create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  create_info.queueFamilyIndex = (uint32_t) r->queue_index_graphics;
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  for (i = 0; i < r->n_frames; ++i) {
+    struct render_frame *frame = r->frames + i;
+
+    result = r->vkCreateCommandPool(
+      r->device,
+      &create_info,
+      NULL,
+      &frame->command_pool
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_POOL;
+    allocate_info.commandPool = frame->command_pool;
+    result = r->vkAllocateCommandBuffers(
+      r->device,
+      &allocate_info,
+      &frame->command_buffer
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER;
+    /* Only recorded on frames that pick up a dedicated transfer queue's work */
+    result = r->vkAllocateCommandBuffers(
+      r->device,
+      &allocate_info,
+      &frame->acquire_buffer
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER;
+  }
+  return RENDER_ERROR_NONE;
+}
+
+/* Recorded lazily, so a fresh set starts out stale */
+static int create_static_buffers(struct render *r) {
   VkCommandBufferAllocateInfo allocate_info = { 0 };
   VkResult result;
 
-  r->command_buffers = malloc(sizeof(VkCommandBuffer) * r->n_swapchain_images);
-  if (!r->command_buffers) return RENDER_ERROR_MEMORY;
+  if (r->n_swapchain_images == 0) return RENDER_ERROR_NONE;
+  r->static_buffers = calloc(r->n_swapchain_images, sizeof(VkCommandBuffer));
+  if (!r->static_buffers) return RENDER_ERROR_MEMORY;
+  r->static_generations = calloc(r->n_swapchain_images, sizeof(uint64_t));
+  if (!r->static_generations) return RENDER_ERROR_MEMORY;
+  ++r->draws_generation;
   allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocate_info.commandPool = r->command_pool;
   allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
@@ -793,12 +1630,104 @@ static int create_command_buffers(struct render *r) {
   result = r->vkAllocateCommandBuffers(
     r->device,
     &allocate_info,
-    r->command_buffers
+    r->static_buffers
+  );
+  if (result != VK_SUCCESS) {
+    free(r->static_buffers);
+    r->static_buffers = NULL;
+    return RENDER_ERROR_VULKAN_COMMAND_BUFFER;
+  }
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * The acquire half of handing each image to the present family, recorded
+ * once per image. The image is rendered with its old contents discarded,
+ * so nothing has to be handed back the other way
+ */
+static int create_present_buffers(struct render *r) {
+  VkCommandPoolCreateInfo pool_info = { 0 };
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  size_t i;
+  VkResult result;
+
+  if (!separate_present(r) || r->n_swapchain_images == 0) {
+    return RENDER_ERROR_NONE;
+  }
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.queueFamilyIndex = (uint32_t) r->queue_index_present;
+  result = r->vkCreateCommandPool(
+    r->device,
+    &pool_info,
+    NULL,
+    &r->present_pool
+  );
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_POOL;
+  r->present_buffers = calloc(r->n_swapchain_images, sizeof(VkCommandBuffer));
+  if (!r->present_buffers) return RENDER_ERROR_MEMORY;
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = r->present_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = (uint32_t) r->n_swapchain_images;
+  result = r->vkAllocateCommandBuffers(
+    r->device,
+    &allocate_info,
+    r->present_buffers
   );
   if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER;
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  /* Nothing fences the present queue, so a resubmit may overlap */
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+  for (i = 0; i < r->n_swapchain_images; ++i) {
+    VkImageMemoryBarrier acquire;
+
+    result = r->vkBeginCommandBuffer(r->present_buffers[i], &begin_info);
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_BEGIN;
+    present_barrier(r, r->swapchain_images[i], &acquire);
+    r->vkCmdPipelineBarrier(
+      r->present_buffers[i],
+      VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      0,
+      0,
+      NULL,
+      0,
+      NULL,
+      1,
+      &acquire
+    );
+    result = r->vkEndCommandBuffer(r->present_buffers[i]);
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_END;
+  }
   return RENDER_ERROR_NONE;
 }
 
+static void destroy_present_buffers(struct render *r) {
+  /* Also frees the buffers */
+  if (r->present_pool) {
+    r->vkDestroyCommandPool(r->device, r->present_pool, NULL);
+  }
+  free(r->present_buffers);
+  r->present_pool = VK_NULL_HANDLE;
+  r->present_buffers = NULL;
+}
+
+static void destroy_static_buffers(struct render *r) {
+  if (r->static_buffers) {
+    r->vkFreeCommandBuffers(
+      r->device,
+      r->command_pool,
+      (uint32_t) r->n_swapchain_images,
+      r->static_buffers
+    );
+  }
+  free(r->static_buffers);
+  free(r->static_generations);
+  r->static_buffers = NULL;
+  r->static_generations = NULL;
+}
+
 static int create_buffer(
   struct render *r,
   VkBuffer *out_buf,
@@ -817,19 +1746,26 @@ static int create_buffer(
   return RENDER_ERROR_NONE;
 }
 
+static int wait_fence(struct render *r, VkFence fence) {
+  VkResult result;
+
+  result = r->vkWaitForFences(r->device, 1, &fence, VK_TRUE, ~(uint64_t) 0);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_FENCE;
+  return RENDER_ERROR_NONE;
+}
+
 static int get_heap_index(
   struct render *r,
   uint32_t memory_type_bit,
   VkMemoryPropertyFlags flags
 ) {
-  int i;
-  VkPhysicalDeviceMemoryProperties props;
+  uint32_t i;
+  VkPhysicalDeviceMemoryProperties *props = &r->memory_props;
 
-  r->vkGetPhysicalDeviceMemoryProperties(r->phys_devices[r->phys_id], &props);
-  for (i = 0; i < props.memoryTypeCount; ++i) {
+  for (i = 0; i < props->memoryTypeCount; ++i) {
     if (memory_type_bit & (1u << i)) {
-      if (props.memoryTypes[i].propertyFlags & flags) {
-        return i;
+      if ((props->memoryTypes[i].propertyFlags & flags) == flags) {
+        return (int) i;
       }
     }
   }
@@ -837,197 +1773,2910 @@ static int get_heap_index(
   return -1;
 }
 
-static int write_data(
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment) {
+  if (alignment <= 1) return value;
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static int range_list_init(struct render_range_list *list, VkDeviceSize size) {
+  list->ranges = malloc(sizeof(struct render_memory_range) * 8);
+  if (!list->ranges) return RENDER_ERROR_MEMORY;
+  list->cap = 8;
+  list->n = 1;
+  list->ranges[0].offset = 0;
+  list->ranges[0].size = size;
+  return RENDER_ERROR_NONE;
+}
+
+static void range_list_destroy(struct render_range_list *list) {
+  free(list->ranges);
+  memset(list, 0, sizeof(struct render_range_list));
+}
+
+static int range_list_insert(
+  struct render_range_list *list,
+  size_t index,
+  VkDeviceSize offset,
+  VkDeviceSize size
+) {
+  if (list->n == list->cap) {
+    size_t cap = list->cap ? list->cap * 2 : 8;
+    struct render_memory_range *ranges;
+
+    ranges = realloc(list->ranges, sizeof(struct render_memory_range) * cap);
+    if (!ranges) return RENDER_ERROR_MEMORY;
+    list->ranges = ranges;
+    list->cap = cap;
+  }
+  memmove(
+    list->ranges + index + 1,
+    list->ranges + index,
+    sizeof(struct render_memory_range) * (list->n - index)
+  );
+  list->ranges[index].offset = offset;
+  list->ranges[index].size = size;
+  ++list->n;
+  return RENDER_ERROR_NONE;
+}
+
+static void range_list_remove(struct render_range_list *list, size_t index) {
+  memmove(
+    list->ranges + index,
+    list->ranges + index + 1,
+    sizeof(struct render_memory_range) * (list->n - index - 1)
+  );
+  --list->n;
+}
+
+/**
+ * First fit. Returns RENDER_ERROR_NONE on success and 1 if no free range is
+ * large enough, so callers can move on to another block
+ */
+static int range_list_alloc(
+  struct render_range_list *list,
+  VkDeviceSize size,
+  VkDeviceSize alignment,
+  VkDeviceSize *out_offset
+) {
+  size_t i;
+
+  for (i = 0; i < list->n; ++i) {
+    struct render_memory_range range = list->ranges[i];
+    VkDeviceSize offset = align_up(range.offset, alignment);
+    VkDeviceSize padding = offset - range.offset;
+
+    if (range.size < padding || range.size - padding < size) continue;
+    if (range.size - padding == size) {
+      range_list_remove(list, i);
+    } else {
+      list->ranges[i].offset = offset + size;
+      list->ranges[i].size = range.size - padding - size;
+    }
+    /* Keep the alignment gap in front of the allocation usable */
+    if (padding) chkerr(range_list_insert(list, i, range.offset, padding));
+    *out_offset = offset;
+    return RENDER_ERROR_NONE;
+  }
+  return 1;
+}
+
+static int range_list_release(
+  struct render_range_list *list,
+  VkDeviceSize offset,
+  VkDeviceSize size
+) {
+  size_t i;
+  int merge_prev, merge_next;
+
+  for (i = 0; i < list->n; ++i) {
+    if (list->ranges[i].offset > offset) break;
+  }
+  merge_prev = (  i > 0
+               && list->ranges[i - 1].offset + list->ranges[i - 1].size
+                  == offset
+               );
+  merge_next = (i < list->n && offset + size == list->ranges[i].offset);
+  if (merge_prev && merge_next) {
+    list->ranges[i - 1].size += size + list->ranges[i].size;
+    range_list_remove(list, i);
+  } else if (merge_prev) {
+    list->ranges[i - 1].size += size;
+  } else if (merge_next) {
+    list->ranges[i].offset = offset;
+    list->ranges[i].size += size;
+  } else {
+    chkerr(range_list_insert(list, i, offset, size));
+  }
+  return RENDER_ERROR_NONE;
+}
+
+static int create_memory_block(
   struct render *r,
-  VkDeviceMemory *mem,
-  void *data,
-  size_t size
+  uint32_t type_index,
+  VkDeviceSize min_size,
+  size_t *out_block
+) {
+  struct render_memory_block *blocks;
+  struct render_memory_block block = { 0 };
+  VkMemoryAllocateInfo allocate_info = { 0 };
+  VkMemoryType *type = r->memory_props.memoryTypes + type_index;
+  VkDeviceSize heap_size = r->memory_props.memoryHeaps[type->heapIndex].size;
+  VkResult result;
+
+  /* Small heaps (e.g. host visible VRAM windows) get smaller blocks */
+  block.size = RENDER_MEMORY_BLOCK_SIZE;
+  if (heap_size / 4 < block.size) block.size = heap_size / 4;
+  if (block.size < min_size) block.size = min_size;
+  block.type_index = type_index;
+  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+  allocate_info.allocationSize = block.size;
+  allocate_info.memoryTypeIndex = type_index;
+  result = r->vkAllocateMemory(r->device, &allocate_info, NULL, &block.memory);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_MEMORY;
+  if (type->propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    result = r->vkMapMemory(
+      r->device,
+      block.memory,
+      0,
+      VK_WHOLE_SIZE,
+      0,
+      &block.mapped
+    );
+    if (result != VK_SUCCESS) {
+      r->vkFreeMemory(r->device, block.memory, NULL);
+      return RENDER_ERROR_VULKAN_MEMORY_MAP;
+    }
+  }
+  chkerrf(range_list_init(&block.free, block.size), {
+    r->vkFreeMemory(r->device, block.memory, NULL);
+  });
+  blocks = realloc(
+    r->memory_blocks,
+    sizeof(struct render_memory_block) * (r->n_memory_blocks + 1)
+  );
+  if (!blocks) {
+    range_list_destroy(&block.free);
+    r->vkFreeMemory(r->device, block.memory, NULL);
+    return RENDER_ERROR_MEMORY;
+  }
+  r->memory_blocks = blocks;
+  r->memory_blocks[r->n_memory_blocks] = block;
+  *out_block = r->n_memory_blocks++;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Sub-allocates from a block of the first memory type matching flags,
+ * reserving a new block when none of the existing ones have room.
+ * Set linear to 0 for optimally tiled images so they never share a
+ * bufferImageGranularity page with buffers
+ */
+static int allocate_memory(
+  struct render *r,
+  VkMemoryRequirements *reqs,
+  VkMemoryPropertyFlags flags,
+  int linear,
+  struct render_allocation *out
+) {
+  int index;
+  size_t i;
+  VkDeviceSize size = reqs->size;
+  VkDeviceSize alignment = reqs->alignment;
+  VkDeviceSize offset;
+  VkMemoryPropertyFlags type_flags;
+  struct render_memory_block *block;
+
+  index = get_heap_index(r, reqs->memoryTypeBits, flags);
+  if (index < 0) return RENDER_ERROR_VULKAN_MEMORY_TYPE;
+  type_flags = r->memory_props.memoryTypes[index].propertyFlags;
+  if (!linear) {
+    VkDeviceSize granularity = r->phys_props.limits.bufferImageGranularity;
+
+    if (alignment < granularity) alignment = granularity;
+    size = align_up(size, granularity);
+  }
+  if (type_flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    /* Flushes of the whole allocation must stay atom aligned */
+    VkDeviceSize atom = r->phys_props.limits.nonCoherentAtomSize;
+
+    if (alignment < atom) alignment = atom;
+    size = align_up(size, atom);
+  }
+  for (i = 0; i < r->n_memory_blocks; ++i) {
+    int err;
+
+    block = r->memory_blocks + i;
+    if (block->type_index != (uint32_t) index) continue;
+    err = range_list_alloc(&block->free, size, alignment, &offset);
+    if (err < 0) return err;
+    if (err == RENDER_ERROR_NONE) break;
+  }
+  if (i == r->n_memory_blocks) {
+    chkerr(create_memory_block(r, (uint32_t) index, size, &i));
+    block = r->memory_blocks + i;
+    chkerr(range_list_alloc(&block->free, size, alignment, &offset));
+  }
+  out->memory = block->memory;
+  out->offset = offset;
+  out->size = size;
+  out->block = i;
+  out->mapped = NULL;
+  if (block->mapped) out->mapped = (unsigned char *) block->mapped + offset;
+  return RENDER_ERROR_NONE;
+}
+
+static void free_memory(struct render *r, struct render_allocation *alloc) {
+  if (!alloc->memory) return;
+  /* Only fails if the list can't grow, which leaks the range */
+  range_list_release(
+    &r->memory_blocks[alloc->block].free,
+    alloc->offset,
+    alloc->size
+  );
+  memset(alloc, 0, sizeof(struct render_allocation));
+}
+
+static void destroy_memory(struct render *r) {
+  size_t i;
+
+  for (i = 0; i < r->n_memory_blocks; ++i) {
+    /* Freeing implicitly unmaps */
+    r->vkFreeMemory(r->device, r->memory_blocks[i].memory, NULL);
+    range_list_destroy(&r->memory_blocks[i].free);
+  }
+  free(r->memory_blocks);
+  r->memory_blocks = NULL;
+  r->n_memory_blocks = 0;
+}
+
+/* Flushes [offset, offset + size) of an allocation, widened to whole atoms */
+static int flush_allocation(
+  struct render *r,
+  struct render_allocation *alloc,
+  VkDeviceSize offset,
+  VkDeviceSize size
 ) {
-  void *dst;
+  VkDeviceSize atom = r->phys_props.limits.nonCoherentAtomSize;
+  VkDeviceSize start, end;
   VkMappedMemoryRange range = { 0 };
+  VkMemoryPropertyFlags flags;
   VkResult result;
 
+  flags = r->memory_props.memoryTypes[
+    r->memory_blocks[alloc->block].type_index
+  ].propertyFlags;
+  if (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) return RENDER_ERROR_NONE;
+  /* Host visible allocations are atom aligned, so this can't overrun */
+  start = offset / atom * atom;
+  end = align_up(offset + size, atom);
+  if (end > alloc->size) end = alloc->size;
   range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
-  range.memory = *mem;
-  range.offset = 0;
-  range.size = size;
-  result = r->vkMapMemory(
-    r->device,
-    range.memory,
-    range.offset,
-    range.size,
-    0,
-    &dst
-  );
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_MEMORY_MAP;
-  memcpy(dst, data, range.size);
+  range.memory = alloc->memory;
+  range.offset = alloc->offset + start;
+  range.size = end - start;
   result = r->vkFlushMappedMemoryRanges(r->device, 1, &range);
   if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_MEMORY_MAP;
-  result = r->vkInvalidateMappedMemoryRanges(r->device, 1, &range);
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_MEMORY_MAP;
-  r->vkUnmapMemory(r->device, *mem);
   return RENDER_ERROR_NONE;
 }
 
 static int allocate_buffer(
   struct render *r,
   VkBuffer *buf,
-  VkDeviceMemory *mem
+  VkMemoryPropertyFlags flags,
+  struct render_allocation *alloc
 ) {
-  int index;
   VkMemoryRequirements reqs;
-  VkMemoryAllocateInfo allocate_info = { 0 };
   VkResult result;
 
   r->vkGetBufferMemoryRequirements(r->device, *buf, &reqs);
-  allocate_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-  allocate_info.allocationSize = reqs.size;
-  index = get_heap_index(
-    r,
-    reqs.memoryTypeBits,
-    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-  );
-  if (index < 0) return RENDER_ERROR_VULKAN_MEMORY;
-  allocate_info.memoryTypeIndex = (uint32_t) index;
-  result = r->vkAllocateMemory(r->device, &allocate_info, NULL, mem);
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_MEMORY;
-  result = r->vkBindBufferMemory(r->device, *buf, *mem, 0);
+  chkerr(allocate_memory(r, &reqs, flags, 1, alloc));
+  result = r->vkBindBufferMemory(r->device, *buf, alloc->memory, alloc->offset);
   if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_MEMORY;
   return RENDER_ERROR_NONE;
 }
 
-static int create_vertex_data(struct render *r) {
-  size_t size_verts = sizeof(float) * 6 * 4;
-  size_t size_indices = sizeof(uint16_t) * 3 * 2;
-  float vertices[] = {
-    -1.0f, -1.0f, 0.0f, 1.0f, 0.0f, 0.0f,
-    -1.0f,  1.0f, 0.0f, 0.0f, 1.0f, 0.0f,
-     1.0f,  1.0f, 0.0f, 0.0f, 0.0f, 1.0f,
-     1.0f, -1.0f, 0.0f, 0.0f, 1.0f, 0.0f,
-  };
-  uint16_t indices[] = { 0, 1, 2, 2, 3, 0 };
+static int allocate_image(
+  struct render *r,
+  VkImage image,
+  VkMemoryPropertyFlags flags,
+  struct render_allocation *alloc
+) {
+  VkMemoryRequirements reqs;
+  VkResult result;
 
-  chkerr(create_buffer(
-    r,
-    &r->vertex_buffer,
-    size_verts,
-    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
-  ));
-  chkerr(create_buffer(
-    r,
-    &r->index_buffer,
-    size_indices,
-    VK_BUFFER_USAGE_INDEX_BUFFER_BIT
-  ));
-  chkerr(allocate_buffer(r, &r->vertex_buffer, &r->vertex_memory));
-  chkerr(allocate_buffer(r, &r->index_buffer, &r->index_memory));
-  chkerr(write_data(r, &r->vertex_memory, vertices, size_verts));
-  chkerr(write_data(r, &r->index_memory, indices, size_indices));
+  r->vkGetImageMemoryRequirements(r->device, image, &reqs);
+  chkerr(allocate_memory(r, &reqs, flags, 0, alloc));
+  result = r->vkBindImageMemory(r->device, image, alloc->memory, alloc->offset);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_MEMORY;
   return RENDER_ERROR_NONE;
 }
 
-static int write_buffers(struct render *r) {
-  size_t i;
-  VkCommandBufferBeginInfo begin_info = { 0 };
+/* Stands in for the swapchain when there is no window */
+static int create_offscreen_images(struct render *r) {
+  VkImageCreateInfo create_info = { 0 };
+  size_t i, n = r->wanted_image_count;
   VkResult result;
 
-  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  begin_info.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
-  for (i = 0; i < r->n_swapchain_images; ++i) {
-    VkRenderPassBeginInfo render_info = { 0 };
-    VkClearValue clear_value = { { { 0 } } };
-
-    result = r->vkBeginCommandBuffer(r->command_buffers[i], &begin_info);
-    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_BEGIN;
-    clear_value.color.float32[3] = 1.0f;
-    render_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    render_info.renderPass = r->render_pass;
-    render_info.framebuffer = r->framebuffers[i];
-    render_info.renderArea.offset.x = 0;
-    render_info.renderArea.offset.y = 0;
-    render_info.renderArea.extent = r->swap_extent;
-    render_info.clearValueCount = 1;
-    render_info.pClearValues = &clear_value;
-    r->vkCmdBeginRenderPass(
-      r->command_buffers[i],
-      &render_info,
-      VK_SUBPASS_CONTENTS_INLINE
+  if (r->requested_extent.width == 0 || r->requested_extent.height == 0) {
+    return RENDER_ERROR_ARGUMENT;
+  }
+  r->swap_extent = r->requested_extent;
+  r->swapchain_images = calloc(n, sizeof(VkImage));
+  if (!r->swapchain_images) return RENDER_ERROR_MEMORY;
+  r->target_allocs = calloc(n, sizeof(struct render_allocation));
+  if (!r->target_allocs) return RENDER_ERROR_MEMORY;
+  r->n_swapchain_images = n;
+  r->target_index = 0;
+  create_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+  create_info.imageType = VK_IMAGE_TYPE_2D;
+  create_info.format = r->format.format;
+  create_info.extent.width = r->swap_extent.width;
+  create_info.extent.height = r->swap_extent.height;
+  create_info.extent.depth = 1;
+  create_info.mipLevels = 1;
+  create_info.arrayLayers = 1;
+  create_info.samples = VK_SAMPLE_COUNT_1_BIT;
+  create_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+  create_info.usage = ( VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                      | VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+                      );
+  create_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+  create_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+  for (i = 0; i < n; ++i) {
+    result = r->vkCreateImage(
+      r->device,
+      &create_info,
+      NULL,
+      r->swapchain_images + i
     );
-    {
-      VkDeviceSize offsets[] = { 0 };
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SWAPCHAIN_IMAGES;
+    chkerr(allocate_image(
+      r,
+      r->swapchain_images[i],
+      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+      r->target_allocs + i
+    ));
+  }
+  r->present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+  return RENDER_ERROR_NONE;
+}
 
-      r->vkCmdBindPipeline(
-        r->command_buffers[i],
-        VK_PIPELINE_BIND_POINT_GRAPHICS,
-        r->pipeline
-      );
-      r->vkCmdBindVertexBuffers(
-        r->command_buffers[i],
-        0,
-        1,
-        &r->vertex_buffer,
-        offsets
-      );
-      r->vkCmdBindIndexBuffer(
-        r->command_buffers[i],
-        r->index_buffer,
-        0,
-        VK_INDEX_TYPE_UINT16
-      );
-      r->vkCmdDrawIndexed(r->command_buffers[i], 6, 1, 0, 0, 0);
+static int create_render_targets(struct render *r) {
+  if (r->headless) return create_offscreen_images(r);
+  return create_swapchain(r);
+}
+
+static void destroy_render_targets(struct render *r) {
+  size_t i;
+
+  destroy_framebuffers(r);
+  if (r->headless && r->swapchain_images) {
+    for (i = 0; i < r->n_swapchain_images; ++i) {
+      r->vkDestroyImage(r->device, r->swapchain_images[i], NULL);
+      free_memory(r, r->target_allocs + i);
     }
-    r->vkCmdEndRenderPass(r->command_buffers[i]);
-    result = r->vkEndCommandBuffer(r->command_buffers[i]);
-    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_END;
   }
-  return RENDER_ERROR_NONE;
+  free(r->target_allocs);
+  free(r->swapchain_images);
+  r->target_allocs = NULL;
+  r->swapchain_images = NULL;
+  r->n_swapchain_images = 0;
 }
 
-static int create_semaphores(struct render *r) {
-  VkSemaphoreCreateInfo create_info = { 0 };
+static int create_upload(struct render *r) {
+  struct render_upload *u = &r->upload;
+  VkCommandPoolCreateInfo pool_info = { 0 };
+  VkCommandBufferAllocateInfo allocate_info = { 0 };
+  VkFenceCreateInfo fence_info = { 0 };
   VkResult result;
 
-  create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-  result = r->vkCreateSemaphore(
+  chkerr(create_buffer(
+    r,
+    &u->staging_buffer,
+    RENDER_STAGING_SIZE,
+    VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+  ));
+  chkerr(allocate_buffer(
+    r,
+    &u->staging_buffer,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+    &u->staging_alloc
+  ));
+  pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  pool_info.queueFamilyIndex = (uint32_t) r->queue_index_transfer;
+  result = r->vkCreateCommandPool(
     r->device,
-    &create_info,
+    &pool_info,
     NULL,
-    &r->image_semaphore
+    &u->command_pool
   );
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SEMAPHORE;
-  result = r->vkCreateSemaphore(
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_POOL;
+  allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocate_info.commandPool = u->command_pool;
+  allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocate_info.commandBufferCount = 1;
+  result = r->vkAllocateCommandBuffers(
     r->device,
-    &create_info,
-    NULL,
-    &r->render_semaphore
+    &allocate_info,
+    &u->command_buffer
   );
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SEMAPHORE;
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER;
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  result = r->vkCreateFence(r->device, &fence_info, NULL, &u->fence);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_FENCE;
+  if (r->has_transfer_queue) {
+    VkSemaphoreCreateInfo semaphore_info = { 0 };
+
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    result = r->vkCreateSemaphore(
+      r->device,
+      &semaphore_info,
+      NULL,
+      &u->semaphore
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SEMAPHORE;
+  }
   return RENDER_ERROR_NONE;
 }
 
-/* **************************************** */
-/* Public */
-/* **************************************** */
+static void destroy_upload(struct render *r) {
+  struct render_upload *u = &r->upload;
 
-int render_init(struct render *r, struct window *w) {
-  if (!r) return RENDER_ERROR_NULL;
-  memset((unsigned char *) r, 0, sizeof(struct render));
-  chkerr(load_vulkan(r));
-  chkerr(load_preinstance_functions(r));
-  chkerr(create_instance(r));
-  chkerr(load_instance_functions(r));
-  chkerr(create_surface(r, w));
-  chkerr(get_devices(r));
+  r->vkDestroyFence(r->device, u->fence, NULL);
+  if (u->semaphore) r->vkDestroySemaphore(r->device, u->semaphore, NULL);
+  free(u->acquires);
+  /* Also frees the command buffer */
+  r->vkDestroyCommandPool(r->device, u->command_pool, NULL);
+  r->vkDestroyBuffer(r->device, u->staging_buffer, NULL);
+  free_memory(r, &u->staging_alloc);
+  memset(u, 0, sizeof(struct render_upload));
+}
+
+/* Blocks until the last upload batch has executed, freeing the staging */
+static int upload_wait(struct render *r) {
+  struct render_upload *u = &r->upload;
+  VkResult result;
+
+  if (!u->in_flight) return RENDER_ERROR_NONE;
+  chkerr(wait_fence(r, u->fence));
+  result = r->vkResetFences(r->device, 1, &u->fence);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_FENCE;
+  u->in_flight = 0;
+  u->staging_used = 0;
   return RENDER_ERROR_NONE;
 }
 
-void render_deinit(struct render *r) {
-  if (!r) return;
-  render_destroy_pipeline(r);
+static int upload_begin(struct render *r) {
+  struct render_upload *u = &r->upload;
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkResult result;
+
+  if (u->recording) return RENDER_ERROR_NONE;
+  chkerr(upload_wait(r));
+  result = r->vkResetCommandPool(r->device, u->command_pool, 0);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_POOL;
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  result = r->vkBeginCommandBuffer(u->command_buffer, &begin_info);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_BEGIN;
+  u->recording = 1;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Submits every copy recorded since the last submission as one batch. On
+ * a dedicated transfer queue the batch's ranges are released to the
+ * graphics family, and a batch going out with a frame signals the
+ * semaphore that frame's submission waits on. Anything else is waited on
+ * through the fence before the ranges are acquired
+ */
+static int upload_submit(struct render *r, int for_frame) {
+  struct render_upload *u = &r->upload;
+  VkMemoryBarrier barrier = { 0 };
+  VkSubmitInfo submit_info = { 0 };
+  VkResult result;
+
+  if (!u->recording) return RENDER_ERROR_NONE;
+  if (r->has_transfer_queue) {
+    VkBufferMemoryBarrier *releases = u->acquires + u->n_acquires
+                                    - u->n_barriers;
+
+    r->vkCmdPipelineBarrier(
+      u->command_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      0,
+      0,
+      NULL,
+      (uint32_t) u->n_barriers,
+      releases,
+      0,
+      NULL
+    );
+    u->n_barriers = 0;
+  } else {
+    /* Make the copies visible to draws in later submissions */
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = ( VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+                            | VK_ACCESS_INDEX_READ_BIT
+                            );
+    r->vkCmdPipelineBarrier(
+      u->command_buffer,
+      VK_PIPELINE_STAGE_TRANSFER_BIT,
+      VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+      0,
+      1,
+      &barrier,
+      0,
+      NULL,
+      0,
+      NULL
+    );
+  }
+  result = r->vkEndCommandBuffer(u->command_buffer);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_END;
+  u->recording = 0;
+  chkerr(flush_allocation(r, &u->staging_alloc, 0, u->staging_used));
+  submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submit_info.commandBufferCount = 1;
+  submit_info.pCommandBuffers = &u->command_buffer;
+  if (r->has_transfer_queue && for_frame) {
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores = &u->semaphore;
+  }
+  result = r->vkQueueSubmit(r->transfer_queue, 1, &submit_info, u->fence);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_QUEUE_SUBMIT;
+  u->in_flight = 1;
+  u->signaled = submit_info.signalSemaphoreCount != 0;
+  return RENDER_ERROR_NONE;
+}
+
+/* Queues the release, and later acquire, of a range the batch writes */
+static int upload_release(
+  struct render *r,
+  VkBuffer buf,
+  VkDeviceSize offset,
+  VkDeviceSize size
+) {
+  struct render_upload *u = &r->upload;
+  VkBufferMemoryBarrier *barrier;
+
+  if (u->n_acquires == u->cap_acquires) {
+    size_t cap = u->cap_acquires ? u->cap_acquires * 2 : 64;
+    VkBufferMemoryBarrier *acquires;
+
+    acquires = realloc(u->acquires, sizeof(VkBufferMemoryBarrier) * cap);
+    if (!acquires) return RENDER_ERROR_MEMORY;
+    u->acquires = acquires;
+    u->cap_acquires = cap;
+  }
+  barrier = u->acquires + u->n_acquires++;
+  memset(barrier, 0, sizeof(VkBufferMemoryBarrier));
+  barrier->sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  /* The release half, upload_acquire() rewrites these for its own half */
+  barrier->srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier->dstAccessMask = 0;
+  barrier->srcQueueFamilyIndex = (uint32_t) r->queue_index_transfer;
+  barrier->dstQueueFamilyIndex = (uint32_t) r->queue_index_graphics;
+  barrier->buffer = buf;
+  barrier->offset = offset;
+  barrier->size = size;
+  ++u->n_barriers;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Records the graphics side of every ownership transfer released since
+ * the last frame into the frame's acquire buffer. Sets *out_used when
+ * there was anything, the buffer then has to go ahead of the frame's
+ */
+static int upload_acquire(
+  struct render *r,
+  struct render_frame *frame,
+  int *out_used
+) {
+  struct render_upload *u = &r->upload;
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  size_t i;
+  VkResult result;
+
+  *out_used = 0;
+  if (u->n_acquires == 0) return RENDER_ERROR_NONE;
+  for (i = 0; i < u->n_acquires; ++i) {
+    u->acquires[i].srcAccessMask = 0;
+    u->acquires[i].dstAccessMask = ( VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT
+                                   | VK_ACCESS_INDEX_READ_BIT
+                                   );
+  }
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  result = r->vkBeginCommandBuffer(frame->acquire_buffer, &begin_info);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_BEGIN;
+  r->vkCmdPipelineBarrier(
+    frame->acquire_buffer,
+    VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+    VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+    0,
+    0,
+    NULL,
+    (uint32_t) u->n_acquires,
+    u->acquires,
+    0,
+    NULL
+  );
+  result = r->vkEndCommandBuffer(frame->acquire_buffer);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_END;
+  u->n_acquires = 0;
+  *out_used = 1;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Writes size bytes at offset into buf. Host visible memory is written
+ * directly, anything else is copied through the staging buffer by the
+ * next upload_submit()
+ */
+static int write_data(
+  struct render *r,
+  VkBuffer buf,
+  struct render_allocation *alloc,
+  VkDeviceSize offset,
+  void *data,
+  size_t size
+) {
+  struct render_upload *u = &r->upload;
+  unsigned char *src = data;
+
+  if (alloc->mapped) {
+    memcpy((unsigned char *) alloc->mapped + offset, data, size);
+    return flush_allocation(r, alloc, offset, size);
+  }
+  while (size > 0) {
+    VkBufferCopy region;
+    VkDeviceSize chunk;
+
+    if (u->staging_used >= RENDER_STAGING_SIZE) {
+      /* Staging is full, the batch has to land before we can reuse it */
+      chkerr(upload_submit(r, 0));
+      chkerr(upload_wait(r));
+    }
+    chkerr(upload_begin(r));
+    chunk = RENDER_STAGING_SIZE - u->staging_used;
+    if (chunk > size) chunk = size;
+    memcpy(
+      (unsigned char *) u->staging_alloc.mapped + u->staging_used,
+      src,
+      (size_t) chunk
+    );
+    region.srcOffset = u->staging_used;
+    region.dstOffset = offset;
+    region.size = chunk;
+    r->vkCmdCopyBuffer(u->command_buffer, u->staging_buffer, buf, 1, &region);
+    if (r->has_transfer_queue) chkerr(upload_release(r, buf, offset, chunk));
+    u->staging_used = align_up(u->staging_used + chunk, 16);
+    src += chunk;
+    offset += chunk;
+    size -= (size_t) chunk;
+  }
+  return RENDER_ERROR_NONE;
+}
+
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1u << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK ((1u << (32 - HANDLE_INDEX_BITS)) - 1)
+
+static void handle_table_init(struct render_handle_table *t, size_t item_size) {
+  memset(t, 0, sizeof(struct render_handle_table));
+  t->item_size = item_size;
+}
+
+static void handle_table_destroy(struct render_handle_table *t) {
+  free(t->items);
+  free(t->slots);
+  free(t->free);
+  handle_table_init(t, t->item_size);
+}
+
+static int handle_table_alloc(
+  struct render_handle_table *t,
+  render_handle *out,
+  void **out_item
+) {
+  uint32_t index;
+  struct render_handle_slot *slot;
+
+  if (t->n_free) {
+    index = t->free[--t->n_free];
+  } else {
+    if (t->n > HANDLE_INDEX_MASK) return RENDER_ERROR_HANDLE;
+    if (t->n == t->cap) {
+      size_t cap = t->cap ? t->cap * 2 : 64;
+      unsigned char *items;
+      struct render_handle_slot *slots;
+      uint32_t *free_list;
+
+      items = realloc(t->items, t->item_size * cap);
+      if (!items) return RENDER_ERROR_MEMORY;
+      t->items = items;
+      slots = realloc(t->slots, sizeof(struct render_handle_slot) * cap);
+      if (!slots) return RENDER_ERROR_MEMORY;
+      t->slots = slots;
+      free_list = realloc(t->free, sizeof(uint32_t) * cap);
+      if (!free_list) return RENDER_ERROR_MEMORY;
+      t->free = free_list;
+      t->cap = cap;
+    }
+    index = (uint32_t) t->n++;
+    t->slots[index].generation = 1;
+  }
+  slot = t->slots + index;
+  slot->live = 1;
+  *out = (slot->generation << HANDLE_INDEX_BITS) | index;
+  *out_item = t->items + t->item_size * index;
+  memset(*out_item, 0, t->item_size);
+  return RENDER_ERROR_NONE;
+}
+
+/* Returns NULL for stale, freed or malformed handles */
+static void *handle_table_get(struct render_handle_table *t, render_handle h) {
+  uint32_t index = h & HANDLE_INDEX_MASK;
+  struct render_handle_slot *slot;
+
+  if (index >= t->n) return NULL;
+  slot = t->slots + index;
+  if (!slot->live) return NULL;
+  if (slot->generation != (h >> HANDLE_INDEX_BITS)) return NULL;
+  return t->items + t->item_size * index;
+}
+
+static void handle_table_free(struct render_handle_table *t, render_handle h) {
+  uint32_t index = h & HANDLE_INDEX_MASK;
+  struct render_handle_slot *slot;
+
+  if (!handle_table_get(t, h)) return;
+  slot = t->slots + index;
+  slot->live = 0;
+  /* Never hand out generation 0, so no handle can ever equal 0 */
+  slot->generation = (slot->generation + 1) & HANDLE_GENERATION_MASK;
+  if (!slot->generation) slot->generation = 1;
+  t->free[t->n_free++] = index;
+}
+
+static int create_geometry(
+  struct render *r,
+  VkDeviceSize vertex_size,
+  VkDeviceSize index_size,
+  size_t *out_geometry
+) {
+  struct render_geometry *geometry;
+  struct render_geometry *g;
+
+  if (vertex_size < RENDER_GEOMETRY_VERTEX_SIZE) {
+    vertex_size = RENDER_GEOMETRY_VERTEX_SIZE;
+  }
+  if (index_size < RENDER_GEOMETRY_INDEX_SIZE) {
+    index_size = RENDER_GEOMETRY_INDEX_SIZE;
+  }
+  geometry = realloc(
+    r->geometry,
+    sizeof(struct render_geometry) * (r->n_geometry + 1)
+  );
+  if (!geometry) return RENDER_ERROR_MEMORY;
+  r->geometry = geometry;
+  g = r->geometry + r->n_geometry++;
+  memset(g, 0, sizeof(struct render_geometry));
+  chkerr(create_buffer(
+    r,
+    &g->vertex_buffer,
+    (size_t) vertex_size,
+    VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+  ));
+  chkerr(create_buffer(
+    r,
+    &g->index_buffer,
+    (size_t) index_size,
+    VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
+  ));
+  chkerr(allocate_buffer(
+    r,
+    &g->vertex_buffer,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    &g->vertex_alloc
+  ));
+  chkerr(allocate_buffer(
+    r,
+    &g->index_buffer,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    &g->index_alloc
+  ));
+  chkerr(range_list_init(&g->vertex_free, vertex_size));
+  chkerr(range_list_init(&g->index_free, index_size));
+  *out_geometry = r->n_geometry - 1;
+  return RENDER_ERROR_NONE;
+}
+
+static void destroy_geometry(struct render *r) {
+  size_t i;
+
+  for (i = 0; i < r->n_geometry; ++i) {
+    struct render_geometry *g = r->geometry + i;
+
+    r->vkDestroyBuffer(r->device, g->vertex_buffer, NULL);
+    r->vkDestroyBuffer(r->device, g->index_buffer, NULL);
+    free_memory(r, &g->vertex_alloc);
+    free_memory(r, &g->index_alloc);
+    range_list_destroy(&g->vertex_free);
+    range_list_destroy(&g->index_free);
+  }
+  free(r->geometry);
+  r->geometry = NULL;
+  r->n_geometry = 0;
+  handle_table_destroy(&r->meshes);
+  free(r->retired_meshes);
+  r->retired_meshes = NULL;
+  r->n_retired_meshes = 0;
+  r->cap_retired_meshes = 0;
+}
+
+/* Finds room for a mesh in one of the shared vertex/index buffer pairs */
+static int geometry_alloc(
+  struct render *r,
+  size_t stride,
+  size_t index_size,
+  struct render_mesh *mesh
+) {
+  size_t i;
+
+  for (i = 0; i <= r->n_geometry; ++i) {
+    struct render_geometry *g;
+    int err;
+
+    if (i == r->n_geometry) {
+      chkerr(create_geometry(r, mesh->vertex_size, mesh->index_size, &i));
+    }
+    g = r->geometry + i;
+    err = range_list_alloc(
+      &g->vertex_free,
+      mesh->vertex_size,
+      stride,
+      &mesh->vertex_offset
+    );
+    if (err < 0) return err;
+    if (err) continue;
+    err = range_list_alloc(
+      &g->index_free,
+      mesh->index_size,
+      index_size,
+      &mesh->index_offset
+    );
+    if (err) {
+      range_list_release(
+        &g->vertex_free,
+        mesh->vertex_offset,
+        mesh->vertex_size
+      );
+      if (err < 0) return err;
+      continue;
+    }
+    mesh->geometry = i;
+    mesh->first_vertex = (int32_t) (mesh->vertex_offset / stride);
+    mesh->first_index = (uint32_t) (mesh->index_offset / index_size);
+    return RENDER_ERROR_NONE;
+  }
+  return RENDER_ERROR_MEMORY;
+}
+
+static void geometry_release(struct render *r, struct render_mesh *mesh) {
+  struct render_geometry *g = r->geometry + mesh->geometry;
+
+  range_list_release(&g->vertex_free, mesh->vertex_offset, mesh->vertex_size);
+  range_list_release(&g->index_free, mesh->index_offset, mesh->index_size);
+}
+
+/* Returns the space of unloaded meshes once no frame can still draw them */
+static void release_retired_meshes(struct render *r) {
+  size_t i = 0;
+
+  while (i < r->n_retired_meshes) {
+    struct render_mesh *mesh = r->retired_meshes + i;
+
+    if (mesh->serial > r->completed_serial) {
+      ++i;
+      continue;
+    }
+    geometry_release(r, mesh);
+    *mesh = r->retired_meshes[--r->n_retired_meshes];
+  }
+}
+
+static int load_mesh(
+  struct render *r,
+  size_t n,
+  void *data,
+  size_t stride,
+  size_t n_indices,
+  void *indices,
+  size_t index_size,
+  render_handle *out_mesh
+) {
+  struct render_mesh mesh = { 0 };
+  struct render_geometry *g;
+  void *item;
+
+  mesh.vertex_size = n;
+  mesh.index_size = n_indices * index_size;
+  mesh.n_indices = (uint32_t) n_indices;
+  mesh.index_type = index_size == sizeof(uint16_t)
+                  ? VK_INDEX_TYPE_UINT16
+                  : VK_INDEX_TYPE_UINT32;
+  chkerr(geometry_alloc(r, stride, index_size, &mesh));
+  g = r->geometry + mesh.geometry;
+  chkerrf(write_data(
+    r,
+    g->vertex_buffer,
+    &g->vertex_alloc,
+    mesh.vertex_offset,
+    data,
+    n
+  ), {
+    geometry_release(r, &mesh);
+  });
+  chkerrf(write_data(
+    r,
+    g->index_buffer,
+    &g->index_alloc,
+    mesh.index_offset,
+    indices,
+    (size_t) mesh.index_size
+  ), {
+    geometry_release(r, &mesh);
+  });
+  chkerrf(handle_table_alloc(&r->meshes, out_mesh, &item), {
+    geometry_release(r, &mesh);
+  });
+  memcpy(item, &mesh, sizeof(struct render_mesh));
+  return RENDER_ERROR_NONE;
+}
+
+static void init_tables(struct render *r) {
+  handle_table_init(&r->meshes, sizeof(struct render_mesh));
+  handle_table_init(&r->pipelines, sizeof(struct render_pipeline));
+}
+
+/* 64-bit FNV-1a, continuing from h */
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  size_t i;
+
+  for (i = 0; i < len; ++i) {
+    h ^= bytes[i];
+    h *= (uint64_t) 1 << 40 | 0x1b3;
+  }
+  return h;
+}
+
+#define HASH_SEED ((uint64_t) 0xcbf29ce4 << 32 | 0x84222325)
+
+/**
+ * Hands out a module for path's SPIR-V, shared by content. A path that
+ * is already loaded isn't read again until no pipeline uses it any more,
+ * so a cached pipeline is found without touching the disk
+ */
+static int acquire_shader(
+  struct render *r,
+  char *path,
+  VkShaderModule *out_module
+) {
+  struct render_shader *shader;
+  unsigned char *source;
+  uint64_t hash;
+  size_t i, len;
+  int err;
+
+  for (i = 0; i < r->n_shaders; ++i) {
+    shader = r->shaders + i;
+    if (strcmp(shader->path, path)) continue;
+    ++shader->refs;
+    *out_module = shader->module;
+    return RENDER_ERROR_NONE;
+  }
+  chkerr(read_shader(path, &len, &source));
+  hash = hash_bytes(HASH_SEED, source, len);
+  for (i = 0; i < r->n_shaders; ++i) {
+    shader = r->shaders + i;
+    if (shader->hash != hash || shader->len != len) continue;
+    if (memcmp(shader->source, source, len)) continue;
+    free(source);
+    ++shader->refs;
+    *out_module = shader->module;
+    return RENDER_ERROR_NONE;
+  }
+  if (r->n_shaders == r->cap_shaders) {
+    size_t cap = r->cap_shaders ? r->cap_shaders * 2 : 16;
+    struct render_shader *shaders;
+
+    shaders = realloc(r->shaders, sizeof(struct render_shader) * cap);
+    if (!shaders) {
+      free(source);
+      return RENDER_ERROR_MEMORY;
+    }
+    r->shaders = shaders;
+    r->cap_shaders = cap;
+  }
+  shader = r->shaders + r->n_shaders;
+  shader->path = malloc(strlen(path) + 1);
+  if (!shader->path) {
+    free(source);
+    return RENDER_ERROR_MEMORY;
+  }
+  strcpy(shader->path, path);
+  err = create_shader(r, source, len, &shader->module);
+  if (err) {
+    free(shader->path);
+    free(source);
+    return err;
+  }
+  shader->hash = hash;
+  shader->len = len;
+  shader->source = source;
+  shader->refs = 1;
+  ++r->n_shaders;
+  *out_module = shader->module;
+  return RENDER_ERROR_NONE;
+}
+
+static void release_shader(struct render *r, VkShaderModule module) {
+  size_t i;
+
+  for (i = 0; i < r->n_shaders; ++i) {
+    if (r->shaders[i].module != module) continue;
+    if (--r->shaders[i].refs) return;
+    r->vkDestroyShaderModule(r->device, module, NULL);
+    free(r->shaders[i].path);
+    free(r->shaders[i].source);
+    r->shaders[i] = r->shaders[--r->n_shaders];
+    return;
+  }
+}
+
+static int acquire_layout(
+  struct render *r,
+  uint32_t push_constant_size,
+  VkPipelineLayout *out_layout
+) {
+  struct render_layout *layout;
+  size_t i;
+
+  for (i = 0; i < r->n_layouts; ++i) {
+    layout = r->layouts + i;
+    if (layout->push_constant_size != push_constant_size) continue;
+    ++layout->refs;
+    *out_layout = layout->layout;
+    return RENDER_ERROR_NONE;
+  }
+  if (r->n_layouts == r->cap_layouts) {
+    size_t cap = r->cap_layouts ? r->cap_layouts * 2 : 4;
+    struct render_layout *layouts;
+
+    layouts = realloc(r->layouts, sizeof(struct render_layout) * cap);
+    if (!layouts) return RENDER_ERROR_MEMORY;
+    r->layouts = layouts;
+    r->cap_layouts = cap;
+  }
+  layout = r->layouts + r->n_layouts;
+  chkerr(create_pipeline_layout(r, push_constant_size, &layout->layout));
+  layout->push_constant_size = push_constant_size;
+  layout->refs = 1;
+  ++r->n_layouts;
+  *out_layout = layout->layout;
+  return RENDER_ERROR_NONE;
+}
+
+static void release_layout(struct render *r, VkPipelineLayout layout) {
+  size_t i;
+
+  for (i = 0; i < r->n_layouts; ++i) {
+    if (r->layouts[i].layout != layout) continue;
+    if (--r->layouts[i].refs) return;
+    r->vkDestroyPipelineLayout(r->device, layout, NULL);
+    r->layouts[i] = r->layouts[--r->n_layouts];
+    return;
+  }
+}
+
+/* Safe on a partially built record, anything unset is simply skipped */
+static void destroy_pipeline_record(
+  struct render *r,
+  struct render_pipeline *p
+) {
+  if (p->pipeline) r->vkDestroyPipeline(r->device, p->pipeline, NULL);
+  if (p->layout) release_layout(r, p->layout);
+  if (p->desc.vert_module) release_shader(r, p->desc.vert_module);
+  if (p->desc.frag_module) release_shader(r, p->desc.frag_module);
+}
+
+static render_handle *pipeline_bucket(struct render *r, uint64_t hash) {
+  return r->pipeline_buckets + (size_t) (hash & (r->n_buckets - 1));
+}
+
+/* Keeps a chain per bucket on average, rehashing as pipelines are added */
+static int index_pipeline(struct render *r, render_handle handle) {
+  struct render_pipeline *p = handle_table_get(&r->pipelines, handle);
+  render_handle *head;
+
+  if (r->n_indexed == r->n_buckets) {
+    render_handle *old = r->pipeline_buckets;
+    size_t i, n_old = r->n_buckets;
+
+    r->n_buckets = n_old ? n_old * 2 : 64;
+    r->pipeline_buckets = calloc(r->n_buckets, sizeof(render_handle));
+    if (!r->pipeline_buckets) {
+      r->pipeline_buckets = old;
+      r->n_buckets = n_old;
+      return RENDER_ERROR_MEMORY;
+    }
+    for (i = 0; i < n_old; ++i) {
+      render_handle h = old[i];
+
+      while (h) {
+        struct render_pipeline *q = handle_table_get(&r->pipelines, h);
+        render_handle next = q->next;
+
+        head = pipeline_bucket(r, q->hash);
+        q->next = *head;
+        *head = h;
+        h = next;
+      }
+    }
+    free(old);
+  }
+  head = pipeline_bucket(r, p->hash);
+  p->next = *head;
+  *head = handle;
+  ++r->n_indexed;
+  return RENDER_ERROR_NONE;
+}
+
+static void unindex_pipeline(struct render *r, render_handle handle) {
+  struct render_pipeline *p = handle_table_get(&r->pipelines, handle);
+  render_handle *link = pipeline_bucket(r, p->hash);
+
+  while (*link) {
+    struct render_pipeline *q = handle_table_get(&r->pipelines, *link);
+
+    if (*link == handle) {
+      *link = p->next;
+      --r->n_indexed;
+      return;
+    }
+    link = &q->next;
+  }
+}
+
+static render_handle find_pipeline(
+  struct render *r,
+  struct render_pipeline_desc *desc,
+  uint64_t hash
+) {
+  render_handle h;
+
+  if (!r->n_buckets) return RENDER_HANDLE_NULL;
+  for (h = *pipeline_bucket(r, hash); h; ) {
+    struct render_pipeline *p = handle_table_get(&r->pipelines, h);
+
+    if (  p->hash == hash
+       && !memcmp(&p->desc, desc, sizeof(struct render_pipeline_desc))
+       ) {
+      return h;
+    }
+    h = p->next;
+  }
+  return RENDER_HANDLE_NULL;
+}
+
+/**
+ * Describes info in out, which holds everything but the VkPipeline once
+ * this returns. When a pipeline was already added with the same
+ * description *out_existing is that one instead, and out holds nothing
+ */
+static int prepare_pipeline(
+  struct render *r,
+  struct render_pipeline_info *info,
+  struct render_pipeline *out,
+  render_handle *out_existing
+) {
+  struct render_pipeline pipeline;
+  render_handle existing;
+
+  *out_existing = RENDER_HANDLE_NULL;
+  memset(&pipeline, 0, sizeof(struct render_pipeline));
+  chkerrf(
+    acquire_shader(r, info->vshader, &pipeline.desc.vert_module),
+    { destroy_pipeline_record(r, &pipeline); }
+  );
+  chkerrf(
+    acquire_shader(r, info->fshader, &pipeline.desc.frag_module),
+    { destroy_pipeline_record(r, &pipeline); }
+  );
+  set_vertex_input(&pipeline.desc, info);
+  pipeline.desc.push_constant_size = (uint32_t) info->push_constant_size;
+  pipeline.desc.topology = info->topology;
+  pipeline.desc.cull = info->cull;
+  pipeline.desc.blend = info->blend;
+  pipeline.hash = hash_bytes(
+    HASH_SEED,
+    &pipeline.desc,
+    sizeof(struct render_pipeline_desc)
+  );
+  existing = find_pipeline(r, &pipeline.desc, pipeline.hash);
+  if (existing) {
+    struct render_pipeline *p = handle_table_get(&r->pipelines, existing);
+
+    destroy_pipeline_record(r, &pipeline);
+    ++p->refs;
+    ++r->pipeline_cache_stats.n_reused;
+    *out_existing = existing;
+    return RENDER_ERROR_NONE;
+  }
+  chkerrf(
+    acquire_layout(r, pipeline.desc.push_constant_size, &pipeline.layout),
+    { destroy_pipeline_record(r, &pipeline); }
+  );
+  pipeline.refs = 1;
+  memcpy(out, &pipeline, sizeof(struct render_pipeline));
+  return RENDER_ERROR_NONE;
+}
+
+/* Takes over a prepared pipeline, tearing it down if that fails */
+static int insert_pipeline(
+  struct render *r,
+  struct render_pipeline *pipeline,
+  render_handle *out_pipeline
+) {
+  void *item;
+
+  chkerrf(handle_table_alloc(&r->pipelines, out_pipeline, &item), {
+    destroy_pipeline_record(r, pipeline);
+  });
+  memcpy(item, pipeline, sizeof(struct render_pipeline));
+  chkerrf(index_pipeline(r, *out_pipeline), {
+    destroy_pipeline_record(r, item);
+    handle_table_free(&r->pipelines, *out_pipeline);
+  });
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Hands back the existing pipeline when one was already built from the
+ * same description, otherwise builds one on top of shared shader modules
+ * and layout
+ */
+static int add_pipeline(
+  struct render *r,
+  struct render_pipeline_info *info,
+  render_handle *out_pipeline
+) {
+  struct render_pipeline pipeline;
+  render_handle existing;
+
+  chkerr(prepare_pipeline(r, info, &pipeline, &existing));
+  if (existing) {
+    *out_pipeline = existing;
+    return RENDER_ERROR_NONE;
+  }
+  chkerrf(create_pipeline(r, &pipeline), {
+    destroy_pipeline_record(r, &pipeline);
+  });
+  pipeline.status = RENDER_PIPELINE_READY;
+  return insert_pipeline(r, &pipeline, out_pipeline);
+}
+
+static void destroy_pipelines(struct render *r) {
+  size_t i;
+
+  for (i = 0; i < r->pipelines.n; ++i) {
+    if (!r->pipelines.slots[i].live) continue;
+    destroy_pipeline_record(
+      r,
+      (struct render_pipeline *) r->pipelines.items + i
+    );
+  }
+  handle_table_destroy(&r->pipelines);
+  free(r->pipeline_buckets);
+  free(r->shaders);
+  free(r->layouts);
+  r->pipeline_buckets = NULL;
+  r->n_buckets = 0;
+  r->n_indexed = 0;
+  r->shaders = NULL;
+  r->n_shaders = 0;
+  r->cap_shaders = 0;
+  r->layouts = NULL;
+  r->n_layouts = 0;
+  r->cap_layouts = 0;
+  r->default_pipeline = RENDER_HANDLE_NULL;
+}
+
+static int create_ring(struct render *r) {
+  struct render_ring *ring = &r->ring;
+  VkMemoryPropertyFlags flags;
+  int err;
+
+  memset(ring, 0, sizeof(struct render_ring));
+  ring->size = r->ring_size;
+  r->uniform_range = RENDER_MAX_DRAW_DATA;
+  if (r->uniform_range > r->phys_props.limits.maxUniformBufferRange) {
+    r->uniform_range = r->phys_props.limits.maxUniformBufferRange;
+  }
+  if (r->uniform_range > ring->size) r->uniform_range = ring->size;
+  /**
+   * Draws only reserve their own data, so a uniform window opened near
+   * the end runs on past it. The extra window keeps that inside the buffer
+   */
+  chkerr(create_buffer(
+    r,
+    &ring->buffer,
+    (size_t) (ring->size + r->uniform_range),
+    ( VK_BUFFER_USAGE_VERTEX_BUFFER_BIT
+    | VK_BUFFER_USAGE_INDEX_BUFFER_BIT
+    | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT
+    | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+    | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+    | VK_BUFFER_USAGE_TRANSFER_SRC_BIT
+    )
+  ));
+  /* Coherent memory lets us skip flushing entirely */
+  err = allocate_buffer(
+    r,
+    &ring->buffer,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    &ring->alloc
+  );
+  if (err == RENDER_ERROR_VULKAN_MEMORY_TYPE) {
+    err = allocate_buffer(
+      r,
+      &ring->buffer,
+      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+      &ring->alloc
+    );
+  }
+  chkerr(err);
+  flags = r->memory_props.memoryTypes[
+    r->memory_blocks[ring->alloc.block].type_index
+  ].propertyFlags;
+  ring->coherent = (flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * One set per frame, each pointing at the start of the ring. Draws move
+ * the window with a dynamic offset, so nothing is allocated or written
+ * after this
+ */
+static int create_descriptors(struct render *r) {
+  VkDescriptorPoolSize pool_size = { 0 };
+  VkDescriptorPoolCreateInfo pool_info = { 0 };
+  VkDescriptorSetLayout layouts[RENDER_MAX_FRAMES_IN_FLIGHT];
+  VkDescriptorSetAllocateInfo allocate_info = { 0 };
+  VkDescriptorBufferInfo buffer_info = { 0 };
+  VkWriteDescriptorSet writes[RENDER_MAX_FRAMES_IN_FLIGHT];
+  size_t i;
+  VkResult result;
+
+  pool_size.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  pool_size.descriptorCount = (uint32_t) r->n_frames;
+  pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  pool_info.maxSets = (uint32_t) r->n_frames;
+  pool_info.poolSizeCount = 1;
+  pool_info.pPoolSizes = &pool_size;
+  result = r->vkCreateDescriptorPool(
+    r->device,
+    &pool_info,
+    NULL,
+    &r->descriptor_pool
+  );
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_DESCRIPTOR_POOL;
+  for (i = 0; i < r->n_frames; ++i) layouts[i] = r->descriptor_set_layout;
+  allocate_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocate_info.descriptorPool = r->descriptor_pool;
+  allocate_info.descriptorSetCount = (uint32_t) r->n_frames;
+  allocate_info.pSetLayouts = layouts;
+  result = r->vkAllocateDescriptorSets(
+    r->device,
+    &allocate_info,
+    r->descriptor_sets
+  );
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_DESCRIPTOR_SET;
+  buffer_info.buffer = r->ring.buffer;
+  buffer_info.offset = 0;
+  buffer_info.range = r->uniform_range;
+  for (i = 0; i < r->n_frames; ++i) {
+    memset(writes + i, 0, sizeof(VkWriteDescriptorSet));
+    writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    writes[i].dstSet = r->descriptor_sets[i];
+    writes[i].dstBinding = 0;
+    writes[i].descriptorCount = 1;
+    writes[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    writes[i].pBufferInfo = &buffer_info;
+  }
+  r->vkUpdateDescriptorSets(
+    r->device,
+    (uint32_t) r->n_frames,
+    writes,
+    0,
+    NULL
+  );
+  return RENDER_ERROR_NONE;
+}
+
+/* Also frees the sets */
+static void destroy_descriptors(struct render *r) {
+  if (r->descriptor_pool) {
+    r->vkDestroyDescriptorPool(r->device, r->descriptor_pool, NULL);
+  }
+  r->descriptor_pool = VK_NULL_HANDLE;
+  memset(r->descriptor_sets, 0, sizeof(r->descriptor_sets));
+}
+
+static void destroy_ring(struct render *r) {
+  r->vkDestroyBuffer(r->device, r->ring.buffer, NULL);
+  free_memory(r, &r->ring.alloc);
+  memset(&r->ring, 0, sizeof(struct render_ring));
+}
+
+static int ring_alloc(
+  struct render *r,
+  VkDeviceSize size,
+  VkDeviceSize alignment,
+  VkDeviceSize *out_offset
+) {
+  struct render_ring *ring = &r->ring;
+  VkDeviceSize pos = ring->head;
+  VkDeviceSize offset = pos % ring->size;
+  VkDeviceSize aligned = align_up(offset, alignment);
+
+  if (aligned + size > ring->size) {
+    /* Never split a range across the end, skip ahead to the start */
+    pos += ring->size - offset;
+    aligned = 0;
+  } else {
+    pos += aligned - offset;
+  }
+  if (pos + size - ring->tail > ring->size) return RENDER_ERROR_RING_FULL;
+  ring->head = pos + size;
+  *out_offset = aligned;
+  return RENDER_ERROR_NONE;
+}
+
+/* Flushes everything written to the ring since the frame began */
+static int flush_ring(struct render *r) {
+  struct render_ring *ring = &r->ring;
+  VkDeviceSize start, end;
+
+  if (ring->coherent || ring->head == ring->frame_start) {
+    return RENDER_ERROR_NONE;
+  }
+  start = ring->frame_start % ring->size;
+  end = ring->head % ring->size;
+  if (ring->head - ring->frame_start >= ring->size || end <= start) {
+    /* Wrapped, flush the tail end and the beginning separately */
+    chkerr(flush_allocation(r, &ring->alloc, start, ring->size - start));
+    if (end) chkerr(flush_allocation(r, &ring->alloc, 0, end));
+    return RENDER_ERROR_NONE;
+  }
+  return flush_allocation(r, &ring->alloc, start, end - start);
+}
+
+/**
+ * Converts the frame's timestamp queries into r->gpu_timings. Only called
+ * once the frame's fence has signaled, so this never waits on the GPU
+ */
+static void read_gpu_timings(struct render *r, struct render_frame *frame) {
+  struct render_gpu_timings *t = &r->gpu_timings;
+  uint64_t results[RENDER_MAX_GPU_QUERIES];
+  double period = (double) r->phys_props.limits.timestampPeriod;
+  size_t i;
+  VkResult result;
+
+  result = r->vkGetQueryPoolResults(
+    r->device,
+    frame->query_pool,
+    0,
+    frame->n_queries,
+    sizeof(results),
+    results,
+    sizeof(uint64_t),
+    VK_QUERY_RESULT_64_BIT
+  );
+  frame->n_queries = 0;
+  if (result != VK_SUCCESS) return;
+  t->serial = frame->serial;
+  t->render_pass_ns = (uint64_t) (
+    (double) ((results[1] - results[0]) & r->timestamp_mask) * period
+  );
+  t->n_regions = frame->n_regions;
+  for (i = 0; i < frame->n_regions; ++i) {
+    uint64_t ticks = results[3 + 2 * i] - results[2 + 2 * i];
+
+    ticks &= r->timestamp_mask;
+    t->regions[i] = frame->regions[i];
+    t->regions[i].ns = (uint64_t) ((double) ticks * period);
+  }
+}
+
+/**
+ * Waits until the GPU has finished with the resources of the frame about
+ * to be recorded. Called lazily by anything that touches per-frame state
+ */
+static int begin_frame(struct render *r) {
+  struct render_frame *frame = r->frames + r->frame_index;
+
+  if (r->frame_begun) return RENDER_ERROR_NONE;
+  chkerr(wait_fence(r, frame->fence));
+  if (frame->n_queries) read_gpu_timings(r, frame);
+  if (frame->serial > r->completed_serial) {
+    r->completed_serial = frame->serial;
+    release_retired_meshes(r);
+  }
+  /* Everything up to where this frame ended last time is free again */
+  if (frame->ring_end > r->ring.tail) r->ring.tail = frame->ring_end;
+  r->ring.frame_start = r->ring.head;
+  r->frame_begun = 1;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Worker pool. Every worker owns a deque of jobs: it pops its own from the
+ * back and, once that runs dry, steals from the front of the others. The
+ * pthread state stays in here so render.h doesn't need pthread.h
+ */
+struct render_job {
+  void (*run)(void *arg, size_t thread);
+  void *arg;
+  struct render_job_group *group;
+};
+
+struct render_deque {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+  size_t cap;
+  struct render_job *jobs;
+};
+
+struct render_worker {
+  struct render_workers *pool;
+  size_t index;
+  pthread_t thread;
+  struct render_deque deque;
+};
+
+struct render_workers {
+  size_t n_threads;
+  struct render_worker workers[RENDER_MAX_WORKER_THREADS];
+  pthread_mutex_t lock;         /* guards everything below and the groups */
+  pthread_cond_t wake;          /* jobs queued or stopping */
+  pthread_cond_t done;          /* a group finished */
+  size_t n_queued;
+  size_t next;                  /* deque the next submission goes to */
+  int stop;
+};
+
+static int deque_push(struct render_deque *d, struct render_job *job) {
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->cap && d->head) {
+    memmove(
+      d->jobs,
+      d->jobs + d->head,
+      sizeof(struct render_job) * (d->tail - d->head)
+    );
+    d->tail -= d->head;
+    d->head = 0;
+  } else if (d->tail == d->cap) {
+    size_t cap = d->cap ? d->cap * 2 : 64;
+    struct render_job *jobs;
+
+    jobs = realloc(d->jobs, sizeof(struct render_job) * cap);
+    if (!jobs) {
+      pthread_mutex_unlock(&d->lock);
+      return RENDER_ERROR_MEMORY;
+    }
+    d->jobs = jobs;
+    d->cap = cap;
+  }
+  d->jobs[d->tail++] = *job;
+  pthread_mutex_unlock(&d->lock);
+  return RENDER_ERROR_NONE;
+}
+
+/* The owner takes the newest job, thieves the oldest */
+static int deque_take(
+  struct render_deque *d,
+  int steal,
+  struct render_job *out
+) {
+  int found = 0;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->head != d->tail) {
+    *out = steal ? d->jobs[d->head++] : d->jobs[--d->tail];
+    if (d->head == d->tail) d->head = d->tail = 0;
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+/* thread == n_threads is the submitting thread, which only steals */
+static int take_job(
+  struct render_workers *pool,
+  size_t thread,
+  struct render_job *out
+) {
+  size_t i;
+  int found = 0;
+
+  if (thread < pool->n_threads) {
+    found = deque_take(&pool->workers[thread].deque, 0, out);
+  }
+  for (i = 1; i <= pool->n_threads && !found; ++i) {
+    size_t victim = (thread + i) % (pool->n_threads + 1);
+
+    if (victim == pool->n_threads) continue;
+    found = deque_take(&pool->workers[victim].deque, 1, out);
+  }
+  if (!found) return 0;
+  pthread_mutex_lock(&pool->lock);
+  --pool->n_queued;
+  pthread_mutex_unlock(&pool->lock);
+  return 1;
+}
+
+static void run_job(
+  struct render_workers *pool,
+  struct render_job *job,
+  size_t thread
+) {
+  job->run(job->arg, thread);
+  pthread_mutex_lock(&pool->lock);
+  if (--job->group->remaining == 0) pthread_cond_broadcast(&pool->done);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_main(void *arg) {
+  struct render_worker *w = arg;
+  struct render_workers *pool = w->pool;
+
+  for (;;) {
+    struct render_job job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->n_queued && !pool->stop) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (take_job(pool, w->index, &job)) run_job(pool, &job, w->index);
+  }
+}
+
+static void workers_destroy(struct render_workers *pool) {
+  size_t i;
+
+  if (!pool) return;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->n_threads; ++i) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+  for (i = 0; i < RENDER_MAX_WORKER_THREADS; ++i) {
+    pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    free(pool->workers[i].deque.jobs);
+  }
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+static int workers_create(size_t n, struct render_workers **out) {
+  struct render_workers *pool;
+  size_t i;
+
+  *out = NULL;
+  pool = calloc(1, sizeof(struct render_workers));
+  if (!pool) return RENDER_ERROR_MEMORY;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  for (i = 0; i < RENDER_MAX_WORKER_THREADS; ++i) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+    pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+  }
+  for (i = 0; i < n; ++i) {
+    struct render_worker *w = pool->workers + i;
+
+    if (pthread_create(&w->thread, NULL, worker_main, w)) {
+      workers_destroy(pool);
+      return RENDER_ERROR_THREAD;
+    }
+    ++pool->n_threads;
+  }
+  *out = pool;
+  return RENDER_ERROR_NONE;
+}
+
+/* Spreads submissions over the deques, idle workers balance the rest */
+static int workers_submit(
+  struct render_workers *pool,
+  struct render_job_group *group,
+  void (*run)(void *arg, size_t thread),
+  void *arg
+) {
+  struct render_job job;
+  struct render_deque *d;
+  int err;
+
+  job.run = run;
+  job.arg = arg;
+  job.group = group;
+  d = &pool->workers[pool->next++ % pool->n_threads].deque;
+  pthread_mutex_lock(&pool->lock);
+  ++group->remaining;
+  pthread_mutex_unlock(&pool->lock);
+  err = deque_push(d, &job);
+  pthread_mutex_lock(&pool->lock);
+  if (err) {
+    --group->remaining;
+  } else {
+    ++pool->n_queued;
+    pthread_cond_signal(&pool->wake);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return err;
+}
+
+/* Runs queued jobs on the calling thread until the group is done */
+static void workers_wait(
+  struct render_workers *pool,
+  struct render_job_group *group
+) {
+  for (;;) {
+    struct render_job job;
+    size_t remaining;
+
+    if (take_job(pool, pool->n_threads, &job)) {
+      run_job(pool, &job, pool->n_threads);
+      continue;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (group->remaining && !pool->n_queued) {
+      pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    remaining = group->remaining;
+    pthread_mutex_unlock(&pool->lock);
+    if (!remaining) return;
+  }
+}
+
+/* A pipeline compiling on one of the compiler's threads */
+struct render_compile {
+  struct render *r;
+  render_handle handle;
+  struct render_pipeline pipeline;  /* private copy, see build_pipeline() */
+  VkPipelineCreationFeedbackFlagsEXT feedback;
+  int err;
+  int done;                         /* guarded by the compiler's lock */
+  struct render_compile *next;
+};
+
+/**
+ * A worker pool of its own, so compiles never queue in front of, or get
+ * picked up by, the threads recording a frame
+ */
+struct render_compiler {
+  struct render_workers *pool;
+  struct render_job_group group;
+  pthread_mutex_t lock;
+  struct render_compile *jobs;      /* submitted and not yet collected */
+};
+
+static void compile_job(void *arg, size_t thread) {
+  struct render_compile *job = arg;
+  struct render_compiler *c = job->r->compiler;
+  int err;
+
+  (void) thread;
+  /* The pipeline cache is internally synchronized */
+  err = build_pipeline(job->r, &job->pipeline, &job->feedback);
+  pthread_mutex_lock(&c->lock);
+  job->err = err;
+  job->done = 1;
+  pthread_mutex_unlock(&c->lock);
+}
+
+/* Hands finished compiles over to their pipelines, never waits */
+static void collect_pipelines(struct render *r) {
+  struct render_compiler *c = r->compiler;
+  struct render_compile **link;
+
+  if (!c) return;
+  pthread_mutex_lock(&c->lock);
+  link = &c->jobs;
+  while (*link) {
+    struct render_compile *job = *link;
+    struct render_pipeline *p;
+
+    if (!job->done) {
+      link = &job->next;
+      continue;
+    }
+    *link = job->next;
+    /* Removing a pending pipeline drains the compiler first */
+    p = handle_table_get(&r->pipelines, job->handle);
+    p->pipeline = job->pipeline.pipeline;
+    p->status = job->err ? job->err : RENDER_PIPELINE_READY;
+    if (job->err) {
+      /* Kept drawing its fallback, but the next request tries again */
+      unindex_pipeline(r, job->handle);
+    } else {
+      count_pipeline(r, job->feedback);
+    }
+    /* Static buffers recorded with the fallback have to pick it up */
+    ++r->draws_generation;
+    free(job);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+static int start_compiler(struct render *r) {
+  struct render_compiler *c;
+  int err;
+
+  if (r->compiler || !r->wanted_compile_threads) return RENDER_ERROR_NONE;
+  c = calloc(1, sizeof(struct render_compiler));
+  if (!c) return RENDER_ERROR_MEMORY;
+  err = workers_create(r->wanted_compile_threads, &c->pool);
+  if (err) {
+    free(c);
+    return err;
+  }
+  pthread_mutex_init(&c->lock, NULL);
+  r->compiler = c;
+  return RENDER_ERROR_NONE;
+}
+
+/* Blocks until every queued compile has landed in its pipeline */
+static void drain_compiler(struct render *r) {
+  if (!r->compiler) return;
+  workers_wait(r->compiler->pool, &r->compiler->group);
+  collect_pipelines(r);
+}
+
+static void stop_compiler(struct render *r) {
+  if (!r->compiler) return;
+  drain_compiler(r);
+  workers_destroy(r->compiler->pool);
+  pthread_mutex_destroy(&r->compiler->lock);
+  free(r->compiler);
+  r->compiler = NULL;
+}
+
+static int check_pipeline_info(
+  struct render *r,
+  struct render_pipeline_info *info
+) {
+  if (  info->topology < RENDER_TOPOLOGY_TRIANGLES
+     || info->topology > RENDER_TOPOLOGY_POINTS
+     || info->cull < RENDER_CULL_BACK
+     || info->cull > RENDER_CULL_FRONT
+     || info->blend < RENDER_BLEND_NONE
+     || info->blend > RENDER_BLEND_ADDITIVE
+     ) {
+    return RENDER_ERROR_ARGUMENT;
+  }
+  if (info->instance_stride) {
+    size_t i;
+
+    if (!info->n_instance_attrs || !info->instance_attrs) {
+      return RENDER_ERROR_ARGUMENT;
+    }
+    if (info->n_instance_attrs > RENDER_MAX_INSTANCE_ATTRS) {
+      return RENDER_ERROR_ARGUMENT;
+    }
+    if (  info->instance_stride
+        > r->phys_props.limits.maxVertexInputBindingStride
+       ) {
+      return RENDER_ERROR_ARGUMENT;
+    }
+    for (i = 0; i < info->n_instance_attrs; ++i) {
+      if (info->instance_attrs[i].offset >= info->instance_stride) {
+        return RENDER_ERROR_ARGUMENT;
+      }
+    }
+  }
+  if (  info->push_constant_size % 4
+     || info->push_constant_size > r->phys_props.limits.maxPushConstantsSize
+     ) {
+    return RENDER_ERROR_ARGUMENT;
+  }
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Like add_pipeline(), but the VkPipeline is built on a compile thread.
+ * The handle is usable straight away, draws going to the fallback until
+ * collect_pipelines() sees the compile through
+ */
+static int add_pipeline_async(
+  struct render *r,
+  struct render_pipeline_info *info,
+  render_handle fallback,
+  render_handle *out_pipeline
+) {
+  struct render_pipeline pipeline;
+  struct render_compile *job;
+  render_handle existing;
+  int err;
+
+  chkerr(start_compiler(r));
+  if (!r->compiler) return add_pipeline(r, info, out_pipeline);
+  chkerr(prepare_pipeline(r, info, &pipeline, &existing));
+  if (existing) {
+    *out_pipeline = existing;
+    return RENDER_ERROR_NONE;
+  }
+  job = calloc(1, sizeof(struct render_compile));
+  if (!job) {
+    destroy_pipeline_record(r, &pipeline);
+    return RENDER_ERROR_MEMORY;
+  }
+  pipeline.status = RENDER_PIPELINE_PENDING;
+  pipeline.fallback = fallback;
+  chkerrf(insert_pipeline(r, &pipeline, out_pipeline), { free(job); });
+  job->r = r;
+  job->handle = *out_pipeline;
+  memcpy(&job->pipeline, &pipeline, sizeof(struct render_pipeline));
+  err = workers_submit(
+    r->compiler->pool,
+    &r->compiler->group,
+    compile_job,
+    job
+  );
+  if (err) {
+    unindex_pipeline(r, *out_pipeline);
+    destroy_pipeline_record(r, &pipeline);
+    handle_table_free(&r->pipelines, *out_pipeline);
+    free(job);
+    return err;
+  }
+  pthread_mutex_lock(&r->compiler->lock);
+  job->next = r->compiler->jobs;
+  r->compiler->jobs = job;
+  pthread_mutex_unlock(&r->compiler->lock);
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Draw keys, high to low: segment (12 bits, bumped by every marker so
+ * sorting never moves a draw across one), pipeline slot (20), geometry
+ * buffer (12) and index type (1). Equal keys keep submission order,
+ * which is too wide for the 19 bits left over
+ */
+#define DRAW_KEY_SEGMENT(k) ((uint32_t) ((k) >> 52))
+#define DRAW_KEY_MAX_SEGMENT 0xfffu
+
+static int compare_draws(const void *a, const void *b) {
+  const struct render_draw_item *da = a;
+  const struct render_draw_item *db = b;
+
+  if (da->key != db->key) return da->key < db->key ? -1 : 1;
+  if (da->order < db->order) return -1;
+  return da->order > db->order;
+}
+
+/**
+ * Assigns timestamp queries to the frame's region markers. Regions nest,
+ * and once the query pool is full further regions are dropped. Those are
+ * always the innermost ones, so the ends still pair up. Regions left open
+ * are returned on the stack and closed after the render pass
+ */
+static size_t resolve_markers(
+  struct render *r,
+  struct render_frame *frame,
+  size_t *stack,
+  int timing
+) {
+  size_t i, depth = 0, dropped = 0;
+
+  frame->n_regions = 0;
+  for (i = 0; i < r->n_markers; ++i) {
+    struct render_draw_marker *marker = r->markers + i;
+    size_t region;
+
+    marker->query = RENDER_QUERY_NONE;
+    if (!timing) continue;
+    if (marker->type == RENDER_MARKER_BEGIN_REGION) {
+      if (frame->n_regions == RENDER_MAX_GPU_REGIONS) {
+        ++dropped;
+        continue;
+      }
+      region = frame->n_regions++;
+      memcpy(
+        frame->regions[region].label,
+        marker->label,
+        RENDER_GPU_LABEL_SIZE
+      );
+      frame->regions[region].ns = 0;
+      stack[depth++] = region;
+      marker->query = (uint32_t) (2 + 2 * region);
+    } else if (marker->type == RENDER_MARKER_END_REGION) {
+      if (dropped) {
+        --dropped;
+        continue;
+      }
+      if (depth == 0) continue;
+      region = stack[--depth];
+      marker->query = (uint32_t) (3 + 2 * region);
+    }
+  }
+  if (timing) frame->n_queries = (uint32_t) (2 + 2 * frame->n_regions);
+  return depth;
+}
+
+/* Points viewport and scissor at area, or the whole target when NULL */
+static void record_viewport(
+  struct render *r,
+  VkCommandBuffer cb,
+  const struct render_viewport *area
+) {
+  VkViewport viewport;
+  VkRect2D scissor;
+
+  scissor.offset.x = 0;
+  scissor.offset.y = 0;
+  scissor.extent = r->swap_extent;
+  if (area && area->width && area->height) {
+    scissor.offset.x = area->x;
+    scissor.offset.y = area->y;
+    scissor.extent.width = area->width;
+    scissor.extent.height = area->height;
+  }
+  viewport.x = (float) scissor.offset.x;
+  viewport.y = (float) scissor.offset.y;
+  viewport.width = (float) scissor.extent.width;
+  viewport.height = (float) scissor.extent.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  r->vkCmdSetViewport(cb, 0, 1, &viewport);
+  r->vkCmdSetScissor(cb, 0, 1, &scissor);
+}
+
+static void record_marker(
+  struct render *r,
+  VkCommandBuffer cb,
+  struct render_draw_marker *marker
+) {
+  if (marker->type == RENDER_MARKER_VIEWPORT) {
+    record_viewport(r, cb, &marker->viewport);
+    return;
+  }
+  if (marker->query == RENDER_QUERY_NONE) return;
+  r->vkCmdWriteTimestamp(
+    cb,
+    marker->type == RENDER_MARKER_BEGIN_REGION
+      ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT
+      : VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+    r->frames[r->frame_index].query_pool,
+    marker->query
+  );
+}
+
+/**
+ * Folds runs of sorted draws sharing a pipeline, geometry buffer and index
+ * type into one indirect draw, their commands packed into the ring. Runs
+ * never cross a marker or a chunk boundary, and draws binding anything of
+ * their own (an instance stream, per-draw data) stay direct. If the ring
+ * fills up the rest of the list simply goes out direct
+ */
+static int pack_indirect(struct render *r) {
+  size_t i = 0;
+
+  while (i < r->n_draws) {
+    struct render_draw_item *first = r->draws + i;
+    struct render_pipeline *p;
+    VkDrawIndexedIndirectCommand *cmds;
+    VkDeviceSize offset;
+    size_t j, end, limit;
+
+    p = handle_table_get(&r->pipelines, first->pipeline);
+    limit = (i / RENDER_DRAWS_PER_CHUNK + 1) * RENDER_DRAWS_PER_CHUNK;
+    if (limit > r->n_draws) limit = r->n_draws;
+    for (end = i; end < limit; ++end) {
+      struct render_draw_item *item = r->draws + end;
+
+      /* Same segment, pipeline slot, geometry and index type */
+      if ((item->key ^ first->key) >> 19) break;
+      if (item->data_size || item->push_size) break;
+      if (!handle_table_get(&r->meshes, item->mesh)) break;
+    }
+    if (!p || p->desc.n_bindings > 1 || end - i < 2) {
+      ++i;
+      continue;
+    }
+    if (ring_alloc(
+      r,
+      sizeof(VkDrawIndexedIndirectCommand) * (end - i),
+      4,
+      &offset
+    )) {
+      return RENDER_ERROR_NONE;
+    }
+    cmds = (VkDrawIndexedIndirectCommand *)
+      ((unsigned char *) r->ring.alloc.mapped + offset);
+    for (j = i; j < end; ++j) {
+      struct render_mesh *mesh = handle_table_get(&r->meshes, r->draws[j].mesh);
+      VkDrawIndexedIndirectCommand *cmd = cmds + (j - i);
+
+      cmd->indexCount = mesh->n_indices;
+      cmd->instanceCount = r->draws[j].n_instances;
+      cmd->firstIndex = mesh->first_index;
+      cmd->vertexOffset = mesh->first_vertex;
+      cmd->firstInstance = 0;
+      r->draws[j].batch_size = 0;
+    }
+    first->batch_size = (uint32_t) (end - i);
+    first->indirect_offset = offset;
+    i = end;
+  }
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Records a slice of the sorted draw list, along with the markers that
+ * fall in front of its draws. Nothing is assumed to be bound on entry
+ */
+static void record_draws(
+  struct render *r,
+  VkCommandBuffer cb,
+  struct render_record_chunk *chunk
+) {
+  VkPipeline bound_pipeline = VK_NULL_HANDLE;
+  VkDescriptorSet set = r->descriptor_sets[r->frame_index];
+  VkDeviceSize bound_data = (VkDeviceSize) -1;
+  uint32_t bound_push_range = 0;
+  size_t bound_geometry = (size_t) -1;
+  VkIndexType bound_index_type = VK_INDEX_TYPE_UINT16;
+  struct render_viewport *area = NULL;
+  size_t i, m = chunk->first_marker;
+
+  /* Dynamic state doesn't carry into secondaries, pick up where it was */
+  while (m-- > 0) {
+    if (r->markers[m].type == RENDER_MARKER_VIEWPORT) {
+      area = &r->markers[m].viewport;
+      break;
+    }
+  }
+  record_viewport(r, cb, area);
+  m = chunk->first_marker;
+  for (i = chunk->first_draw; i < chunk->end_draw; ++i) {
+    struct render_draw_item *item = r->draws + i;
+    struct render_pipeline *p;
+    struct render_mesh *mesh;
+
+    while (  m < chunk->end_marker
+          && r->markers[m].segment <= DRAW_KEY_SEGMENT(item->key)
+          ) {
+      record_marker(r, cb, r->markers + m++);
+    }
+    if (item->batch_size == 0) continue;
+    /* Either may have been removed after the draw was queued */
+    p = handle_table_get(&r->pipelines, item->pipeline);
+    mesh = handle_table_get(&r->meshes, item->mesh);
+    /* Still compiling, stand in with the fallback or skip the draw */
+    if (p && !p->pipeline) p = handle_table_get(&r->pipelines, p->fallback);
+    if (!p || !p->pipeline || !mesh) continue;
+    if (item->push_size > p->desc.push_constant_size) continue;
+    if (p->pipeline != bound_pipeline) {
+      r->vkCmdBindPipeline(cb, VK_PIPELINE_BIND_POINT_GRAPHICS, p->pipeline);
+      bound_pipeline = p->pipeline;
+      /* A different push constant range disturbs the bound set */
+      if (p->desc.push_constant_size != bound_push_range) {
+        bound_data = (VkDeviceSize) -1;
+        bound_push_range = p->desc.push_constant_size;
+      }
+    }
+    if (item->push_size) {
+      r->vkCmdPushConstants(
+        cb,
+        p->layout,
+        VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT,
+        0,
+        item->push_size,
+        r->push_data + item->push_offset
+      );
+    }
+    if (item->data_size && item->data_offset != bound_data) {
+      uint32_t offset = (uint32_t) item->data_offset;
+
+      r->vkCmdBindDescriptorSets(
+        cb,
+        VK_PIPELINE_BIND_POINT_GRAPHICS,
+        p->layout,
+        0,
+        1,
+        &set,
+        1,
+        &offset
+      );
+      bound_data = item->data_offset;
+    }
+    if (p->desc.n_bindings > 1) {
+      r->vkCmdBindVertexBuffers(
+        cb,
+        RENDER_INSTANCE_BINDING,
+        1,
+        &r->ring.buffer,
+        &item->instance_offset
+      );
+    }
+    if (mesh->geometry != bound_geometry) {
+      struct render_geometry *g = r->geometry + mesh->geometry;
+      VkDeviceSize offset = 0;
+
+      r->vkCmdBindVertexBuffers(cb, 0, 1, &g->vertex_buffer, &offset);
+      r->vkCmdBindIndexBuffer(cb, g->index_buffer, 0, mesh->index_type);
+      bound_geometry = mesh->geometry;
+      bound_index_type = mesh->index_type;
+    } else if (mesh->index_type != bound_index_type) {
+      struct render_geometry *g = r->geometry + mesh->geometry;
+
+      r->vkCmdBindIndexBuffer(cb, g->index_buffer, 0, mesh->index_type);
+      bound_index_type = mesh->index_type;
+    }
+    if (item->batch_size > 1 && r->phys_features.multiDrawIndirect) {
+      r->vkCmdDrawIndexedIndirect(
+        cb,
+        r->ring.buffer,
+        item->indirect_offset,
+        item->batch_size,
+        sizeof(VkDrawIndexedIndirectCommand)
+      );
+    } else if (item->batch_size > 1) {
+      uint32_t j;
+
+      /* Without multiDrawIndirect each command needs a call of its own */
+      for (j = 0; j < item->batch_size; ++j) {
+        r->vkCmdDrawIndexedIndirect(
+          cb,
+          r->ring.buffer,
+          item->indirect_offset + j * sizeof(VkDrawIndexedIndirectCommand),
+          1,
+          sizeof(VkDrawIndexedIndirectCommand)
+        );
+      }
+    } else {
+      r->vkCmdDrawIndexed(
+        cb,
+        mesh->n_indices,
+        item->n_instances,
+        mesh->first_index,
+        mesh->first_vertex,
+        0
+      );
+    }
+  }
+  while (m < chunk->end_marker) record_marker(r, cb, r->markers + m++);
+}
+
+/* Hands out the next secondary buffer of a thread's pool for this frame */
+static int thread_pool_buffer(
+  struct render *r,
+  struct render_thread_pool *tp,
+  VkCommandBuffer *out
+) {
+  if (tp->used == tp->n_buffers) {
+    VkCommandBufferAllocateInfo allocate_info = { 0 };
+    VkCommandBuffer *buffers;
+    VkResult result;
+
+    buffers = realloc(
+      tp->buffers,
+      sizeof(VkCommandBuffer) * (tp->n_buffers + 1)
+    );
+    if (!buffers) return RENDER_ERROR_MEMORY;
+    tp->buffers = buffers;
+    allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocate_info.commandPool = tp->pool;
+    allocate_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    allocate_info.commandBufferCount = 1;
+    result = r->vkAllocateCommandBuffers(
+      r->device,
+      &allocate_info,
+      tp->buffers + tp->n_buffers
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER;
+    ++tp->n_buffers;
+  }
+  *out = tp->buffers[tp->used++];
+  return RENDER_ERROR_NONE;
+}
+
+/* Job body: records one chunk into a secondary buffer of the thread */
+static void record_chunk(void *arg, size_t thread) {
+  struct render_record_chunk *chunk = arg;
+  struct render *r = chunk->r;
+  struct render_frame *frame = r->frames + r->frame_index;
+  VkCommandBufferInheritanceInfo inheritance_info = { 0 };
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkCommandBuffer cb;
+  VkResult result;
+
+  chunk->err = thread_pool_buffer(r, frame->thread_pools + thread, &cb);
+  if (chunk->err) return;
+  inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritance_info.renderPass = r->render_pass;
+  inheritance_info.subpass = 0;
+  inheritance_info.framebuffer = r->framebuffers[chunk->image_index];
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  begin_info.flags = ( VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+                     | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT
+                     );
+  begin_info.pInheritanceInfo = &inheritance_info;
+  result = r->vkBeginCommandBuffer(cb, &begin_info);
+  if (result != VK_SUCCESS) {
+    chunk->err = RENDER_ERROR_VULKAN_COMMAND_BUFFER_BEGIN;
+    return;
+  }
+  record_draws(r, cb, chunk);
+  result = r->vkEndCommandBuffer(cb);
+  if (result != VK_SUCCESS) {
+    chunk->err = RENDER_ERROR_VULKAN_COMMAND_BUFFER_END;
+    return;
+  }
+  chunk->buffer = cb;
+}
+
+/**
+ * Splits the sorted draw list into fixed size chunks, each taking the
+ * markers that precede its draws. The last chunk also takes the markers
+ * after the final draw
+ */
+static int split_chunks(struct render *r, uint32_t image_index) {
+  size_t n = (r->n_draws + RENDER_DRAWS_PER_CHUNK - 1)
+           / RENDER_DRAWS_PER_CHUNK;
+  size_t i, m = 0;
+
+  if (n > r->cap_chunks) {
+    struct render_record_chunk *chunks;
+    VkCommandBuffer *buffers;
+
+    chunks = realloc(r->chunks, sizeof(struct render_record_chunk) * n);
+    if (!chunks) return RENDER_ERROR_MEMORY;
+    r->chunks = chunks;
+    buffers = realloc(r->chunk_buffers, sizeof(VkCommandBuffer) * n);
+    if (!buffers) return RENDER_ERROR_MEMORY;
+    r->chunk_buffers = buffers;
+    r->cap_chunks = n;
+  }
+  for (i = 0; i < n; ++i) {
+    struct render_record_chunk *chunk = r->chunks + i;
+
+    chunk->r = r;
+    chunk->image_index = image_index;
+    chunk->first_draw = i * RENDER_DRAWS_PER_CHUNK;
+    chunk->end_draw = chunk->first_draw + RENDER_DRAWS_PER_CHUNK;
+    if (chunk->end_draw > r->n_draws) chunk->end_draw = r->n_draws;
+    chunk->first_marker = m;
+    if (i + 1 == n) {
+      m = r->n_markers;
+    } else {
+      uint32_t segment = DRAW_KEY_SEGMENT(r->draws[chunk->end_draw].key);
+
+      while (m < r->n_markers && r->markers[m].segment <= segment) ++m;
+    }
+    chunk->end_marker = m;
+    chunk->buffer = VK_NULL_HANDLE;
+    chunk->err = RENDER_ERROR_NONE;
+  }
+  r->n_chunks = n;
+  return RENDER_ERROR_NONE;
+}
+
+/* Records the chunks across the worker pool, the caller helping out */
+static int record_parallel(struct render *r, VkCommandBuffer primary) {
+  struct render_frame *frame = r->frames + r->frame_index;
+  struct render_job_group group = { 0 };
+  size_t i;
+
+  for (i = 0; i < frame->n_thread_pools; ++i) {
+    struct render_thread_pool *tp = frame->thread_pools + i;
+    VkResult result;
+
+    /* The frame's fence has signaled, nothing here is still in use */
+    result = r->vkResetCommandPool(r->device, tp->pool, 0);
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_POOL;
+    tp->used = 0;
+  }
+  for (i = 0; i < r->n_chunks; ++i) {
+    chkerr(workers_submit(r->workers, &group, record_chunk, r->chunks + i));
+  }
+  workers_wait(r->workers, &group);
+  for (i = 0; i < r->n_chunks; ++i) chkerr(r->chunks[i].err);
+  for (i = 0; i < r->n_chunks; ++i) {
+    r->chunk_buffers[i] = r->chunks[i].buffer;
+  }
+  r->vkCmdExecuteCommands(primary, (uint32_t) r->n_chunks, r->chunk_buffers);
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Records the whole draw list into cb. Items are sorted so runs sharing a
+ * pipeline and geometry buffer bind only once. Large dynamic lists are
+ * split into chunks recorded into secondary buffers on the worker
+ * threads, then executed in order from the primary. Static buffers are
+ * replayed across frames, so they record inline and without timestamps
+ */
+static int record_commands(
+  struct render *r,
+  VkCommandBuffer cb,
+  uint32_t image_index,
+  int dynamic
+) {
+  struct render_frame *frame = r->frames + r->frame_index;
+  size_t stack[RENDER_MAX_GPU_REGIONS];
+  size_t depth;
+  int parallel, timing = dynamic && r->gpu_timing;
+  VkCommandBufferBeginInfo begin_info = { 0 };
+  VkRenderPassBeginInfo render_info = { 0 };
+  VkClearValue clear_value = { { { 0 } } };
+  VkResult result;
+  size_t i;
+
+  qsort(r->draws, r->n_draws, sizeof(struct render_draw_item), compare_draws);
+  for (i = 0; i < r->n_draws; ++i) r->draws[i].batch_size = 1;
+  /* Indirect commands live in the ring, which static buffers outlive */
+  if (dynamic && r->draw_indirect) chkerr(pack_indirect(r));
+  depth = resolve_markers(r, frame, stack, timing);
+  parallel = dynamic
+          && r->workers
+          && r->n_draws >= 2 * RENDER_DRAWS_PER_CHUNK;
+  if (parallel) chkerr(split_chunks(r, image_index));
+  begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  if (dynamic) begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  result = r->vkBeginCommandBuffer(cb, &begin_info);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_BEGIN;
+  if (timing) {
+    r->vkCmdResetQueryPool(cb, frame->query_pool, 0, RENDER_MAX_GPU_QUERIES);
+    r->vkCmdWriteTimestamp(
+      cb,
+      VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+      frame->query_pool,
+      0
+    );
+  }
+  clear_value.color.float32[3] = 1.0f;
+  render_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  render_info.renderPass = r->render_pass;
+  render_info.framebuffer = r->framebuffers[image_index];
+  render_info.renderArea.offset.x = 0;
+  render_info.renderArea.offset.y = 0;
+  render_info.renderArea.extent = r->swap_extent;
+  render_info.clearValueCount = 1;
+  render_info.pClearValues = &clear_value;
+  if (parallel) {
+    r->vkCmdBeginRenderPass(
+      cb,
+      &render_info,
+      VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+    );
+    chkerr(record_parallel(r, cb));
+  } else {
+    struct render_record_chunk all = { 0 };
+
+    all.end_draw = r->n_draws;
+    all.end_marker = r->n_markers;
+    r->vkCmdBeginRenderPass(cb, &render_info, VK_SUBPASS_CONTENTS_INLINE);
+    record_draws(r, cb, &all);
+  }
+  r->vkCmdEndRenderPass(cb);
+  if (separate_present(r)) {
+    VkImageMemoryBarrier release;
+
+    present_barrier(r, r->swapchain_images[image_index], &release);
+    release.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    r->vkCmdPipelineBarrier(
+      cb,
+      VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      0,
+      0,
+      NULL,
+      0,
+      NULL,
+      1,
+      &release
+    );
+  }
+  if (timing) {
+    /* Close whatever the caller left open */
+    while (depth) {
+      r->vkCmdWriteTimestamp(
+        cb,
+        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+        frame->query_pool,
+        (uint32_t) (3 + 2 * stack[--depth])
+      );
+    }
+    r->vkCmdWriteTimestamp(
+      cb,
+      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+      frame->query_pool,
+      1
+    );
+  }
+  result = r->vkEndCommandBuffer(cb);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_BUFFER_END;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Records the command buffer render_update() submits for image_index. In
+ * static mode the image's buffer is only re-recorded after the draw list
+ * changed, the image fence having already retired its last use
+ */
+static int record_frame(
+  struct render *r,
+  uint32_t image_index,
+  VkCommandBuffer *out
+) {
+  struct render_frame *frame = r->frames + r->frame_index;
+  VkResult result;
+
+  frame->n_queries = 0;
+  /* The frame's fence has signaled, nothing in the pool is in use */
+  result = r->vkResetCommandPool(r->device, frame->command_pool, 0);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_POOL;
+  if (r->record_mode == RENDER_RECORD_STATIC) {
+    *out = r->static_buffers[image_index];
+    if (r->static_generations[image_index] == r->draws_generation) {
+      return RENDER_ERROR_NONE;
+    }
+    chkerr(record_commands(r, *out, image_index, 0));
+    r->static_generations[image_index] = r->draws_generation;
+    return RENDER_ERROR_NONE;
+  }
+  *out = frame->command_buffer;
+  return record_commands(r, *out, image_index, 1);
+}
+
+static void clear_draws(struct render *r) {
+  ++r->draws_generation;
+  r->n_draws = 0;
+  r->push_used = 0;
+  r->n_markers = 0;
+  r->draw_segment = 0;
+}
+
+/**
+ * A frame that never gets submitted. Dynamic draws are gone with it, and
+ * so is everything they put in the ring, which nothing will ever free
+ */
+static void drop_frame(struct render *r) {
+  if (r->record_mode != RENDER_RECORD_DYNAMIC) return;
+  clear_draws(r);
+  r->ring.head = r->ring.frame_start;
+}
+
+static int push_marker(
+  struct render *r,
+  int type,
+  const char *label
+) {
+  struct render_draw_marker *marker;
+
+  if (r->draw_segment == DRAW_KEY_MAX_SEGMENT) return RENDER_ERROR_ARGUMENT;
+  if (r->n_markers == r->cap_markers) {
+    size_t cap = r->cap_markers ? r->cap_markers * 2 : 16;
+    struct render_draw_marker *markers;
+
+    markers = realloc(r->markers, sizeof(struct render_draw_marker) * cap);
+    if (!markers) return RENDER_ERROR_MEMORY;
+    r->markers = markers;
+    r->cap_markers = cap;
+  }
+  ++r->draws_generation;
+  marker = r->markers + r->n_markers++;
+  marker->segment = ++r->draw_segment;
+  marker->type = type;
+  memset(marker->label, 0, RENDER_GPU_LABEL_SIZE);
+  if (label) strncpy(marker->label, label, RENDER_GPU_LABEL_SIZE - 1);
+  memset(&marker->viewport, 0, sizeof(struct render_viewport));
+  return RENDER_ERROR_NONE;
+}
+
+/* Fence of the frame currently rendering to each swapchain image */
+static int reset_image_fences(struct render *r) {
+  free(r->image_fences);
+  r->image_fences = NULL;
+  if (r->n_swapchain_images == 0) return RENDER_ERROR_NONE;
+  r->image_fences = calloc(r->n_swapchain_images, sizeof(VkFence));
+  if (!r->image_fences) return RENDER_ERROR_MEMORY;
+  return RENDER_ERROR_NONE;
+}
+
+static int init_gpu_timing(struct render *r) {
+  uint32_t bits;
+
+  memset(&r->gpu_timings, 0, sizeof(r->gpu_timings));
+  r->gpu_timing = 0;
+  if (!r->wants_gpu_timing) return RENDER_ERROR_NONE;
+  bits = r->queue_props[r->queue_index_graphics].timestampValidBits;
+  if (bits == 0) return RENDER_ERROR_NONE;
+  r->timestamp_mask = bits >= 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << bits) - 1;
+  r->gpu_timing = 1;
+  return RENDER_ERROR_NONE;
+}
+
+static int create_frames(struct render *r) {
+  VkSemaphoreCreateInfo semaphore_info = { 0 };
+  VkFenceCreateInfo fence_info = { 0 };
+  VkQueryPoolCreateInfo query_info = { 0 };
+  size_t i;
+  VkResult result;
+
+  semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+  /* Start signaled so the first wait on each frame returns immediately */
+  fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+  query_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  query_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  query_info.queryCount = RENDER_MAX_GPU_QUERIES;
+  r->n_frames = r->frames_in_flight;
+  r->frame_index = 0;
+  r->frame_begun = 0;
+  chkerr(init_gpu_timing(r));
+  for (i = 0; i < r->n_frames; ++i) {
+    struct render_frame *frame = r->frames + i;
+
+    result = r->vkCreateSemaphore(
+      r->device,
+      &semaphore_info,
+      NULL,
+      &frame->image_semaphore
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SEMAPHORE;
+    result = r->vkCreateSemaphore(
+      r->device,
+      &semaphore_info,
+      NULL,
+      &frame->render_semaphore
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SEMAPHORE;
+    result = r->vkCreateFence(r->device, &fence_info, NULL, &frame->fence);
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_FENCE;
+    if (separate_present(r)) {
+      result = r->vkCreateSemaphore(
+        r->device,
+        &semaphore_info,
+        NULL,
+        &frame->present_semaphore
+      );
+      if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_SEMAPHORE;
+    }
+    if (!r->gpu_timing) continue;
+    result = r->vkCreateQueryPool(
+      r->device,
+      &query_info,
+      NULL,
+      &frame->query_pool
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_QUERY_POOL;
+  }
+  return reset_image_fences(r);
+}
+
+static void destroy_frames(struct render *r) {
+  size_t i;
+
+  for (i = 0; i < r->n_frames; ++i) {
+    struct render_frame *frame = r->frames + i;
+
+    r->vkDestroySemaphore(r->device, frame->image_semaphore, NULL);
+    r->vkDestroySemaphore(r->device, frame->render_semaphore, NULL);
+    if (frame->present_semaphore) {
+      r->vkDestroySemaphore(r->device, frame->present_semaphore, NULL);
+    }
+    r->vkDestroyFence(r->device, frame->fence, NULL);
+    /* Also frees the frame's command buffer */
+    if (frame->command_pool) {
+      r->vkDestroyCommandPool(r->device, frame->command_pool, NULL);
+    }
+    if (frame->query_pool) {
+      r->vkDestroyQueryPool(r->device, frame->query_pool, NULL);
+    }
+  }
+  memset(r->frames, 0, sizeof(r->frames));
+  free(r->image_fences);
+  r->image_fences = NULL;
+  r->n_frames = 0;
+}
+
+/**
+ * Starts the worker threads and gives every frame a command pool per
+ * recording thread. Without workers everything records inline into the
+ * frames' primary buffers
+ */
+static int create_workers(struct render *r) {
+  VkCommandPoolCreateInfo create_info = { 0 };
+  size_t i, j;
+  VkResult result;
+
+  if (r->wanted_workers == 0) return RENDER_ERROR_NONE;
+  chkerr(workers_create(r->wanted_workers, &r->workers));
+  create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  /* Reset as a whole once the frame's fence signals */
+  create_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  create_info.queueFamilyIndex = (uint32_t) r->queue_index_graphics;
+  for (i = 0; i < r->n_frames; ++i) {
+    struct render_frame *frame = r->frames + i;
+
+    frame->thread_pools = calloc(
+      r->wanted_workers + 1,
+      sizeof(struct render_thread_pool)
+    );
+    if (!frame->thread_pools) return RENDER_ERROR_MEMORY;
+    frame->n_thread_pools = r->wanted_workers + 1;
+    for (j = 0; j < frame->n_thread_pools; ++j) {
+      result = r->vkCreateCommandPool(
+        r->device,
+        &create_info,
+        NULL,
+        &frame->thread_pools[j].pool
+      );
+      if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_COMMAND_POOL;
+    }
+  }
+  return RENDER_ERROR_NONE;
+}
+
+/* Joins the workers first, nothing may be recording after that */
+static void destroy_workers(struct render *r) {
+  size_t i, j;
+
+  workers_destroy(r->workers);
+  r->workers = NULL;
+  for (i = 0; i < r->n_frames; ++i) {
+    struct render_frame *frame = r->frames + i;
+
+    for (j = 0; j < frame->n_thread_pools; ++j) {
+      struct render_thread_pool *tp = frame->thread_pools + j;
+
+      /* Also frees the pool's secondary buffers */
+      if (tp->pool) r->vkDestroyCommandPool(r->device, tp->pool, NULL);
+      free(tp->buffers);
+    }
+    free(frame->thread_pools);
+    frame->thread_pools = NULL;
+    frame->n_thread_pools = 0;
+  }
+  free(r->chunks);
+  free(r->chunk_buffers);
+  r->chunks = NULL;
+  r->chunk_buffers = NULL;
+  r->n_chunks = 0;
+  r->cap_chunks = 0;
+}
+
+/**
+ * Rebuilds everything that depends on the surface extent. The device,
+ * pipelines, memory and frame resources all stay as they are, viewport
+ * and scissor being set while recording
+ */
+static int recreate_swapchain(struct render *r) {
+  r->vkDeviceWaitIdle(r->device);
+  destroy_static_buffers(r);
+  destroy_present_buffers(r);
+  destroy_render_targets(r);
+  chkerr(create_render_targets(r));
+  if (r->swapchain_dirty) return RENDER_ERROR_NONE;
+  chkerr(create_framebuffers(r));
+  chkerr(create_static_buffers(r));
+  chkerr(create_present_buffers(r));
+  chkerr(reset_image_fences(r));
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Undoes render_configure() down to the device. Everything left unset is
+ * skipped, so this also backs out a configure that failed once the
+ * device functions were loaded
+ */
+static void destroy_configured(struct render *r) {
+  /* Frames may still be executing now that we no longer wait per frame */
+  r->vkDeviceWaitIdle(r->device);
+  stop_compiler(r);
+  destroy_workers(r);
+  destroy_frames(r);
+  destroy_static_buffers(r);
+  destroy_present_buffers(r);
+  destroy_geometry(r);
+  destroy_descriptors(r);
+  destroy_ring(r);
+  destroy_upload(r);
+  /* Offscreen targets hold allocations, so go before the memory */
+  destroy_render_targets(r);
+  destroy_memory(r);
+  free(r->draws);
+  r->draws = NULL;
+  r->n_draws = 0;
+  r->cap_draws = 0;
+  free(r->push_data);
+  r->push_data = NULL;
+  r->push_used = 0;
+  r->cap_push = 0;
+  free(r->markers);
+  r->markers = NULL;
+  r->n_markers = 0;
+  r->cap_markers = 0;
+  r->draw_segment = 0;
+  r->vkDestroyCommandPool(r->device, r->command_pool, NULL);
+  r->command_pool = VK_NULL_HANDLE;
+  if (!r->headless) {
+    r->vkDestroySwapchainKHR(r->device, r->swapchain, NULL);
+    r->swapchain = VK_NULL_HANDLE;
+  }
+  /* r->vkDestroyShaderModule(r->device, r->vert_module, NULL); */
+  /* r->vkDestroyShaderModule(r->device, r->frag_module, NULL); */
+  destroy_pipelines(r);
+  r->vkDestroyDescriptorSetLayout(r->device, r->descriptor_set_layout, NULL);
+  r->descriptor_set_layout = VK_NULL_HANDLE;
+  destroy_pipeline_cache(r);
+  r->vkDestroyRenderPass(r->device, r->render_pass, NULL);
+  r->render_pass = VK_NULL_HANDLE;
+  /* Reconfiguring may pick another device, so this one goes too */
+  destroy_device(r);
+  r->has_pipeline = 0;
+}
+
+/* **************************************** */
+/* Public */
+/* **************************************** */
+
+int render_init(struct render *r, struct window *w) {
+  if (!r) return RENDER_ERROR_NULL;
+  memset((unsigned char *) r, 0, sizeof(struct render));
+  r->frames_in_flight = RENDER_DEFAULT_FRAMES_IN_FLIGHT;
+  r->ring_size = RENDER_DEFAULT_RING_SIZE;
+  r->wanted_compile_threads = RENDER_DEFAULT_COMPILE_THREADS;
+  r->wanted_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+  r->wanted_image_count = RENDER_DEFAULT_IMAGE_COUNT;
+  /* Without a window everything renders into offscreen images */
+  r->headless = !w;
+  chkerr(profiled(r, load_vulkan(r)));
+  chkerr(profiled(r, load_preinstance_functions(r)));
+  chkerr(profiled(r, create_instance(r)));
+  chkerr(profiled(r, load_instance_functions(r)));
+  chkerr(profiled(r, create_surface(r, w)));
+  chkerr(profiled(r, get_devices(r)));
+  return RENDER_ERROR_NONE;
+}
+
+void render_deinit(struct render *r) {
+  if (!r) return;
+  render_destroy_pipeline(r);
+  free(r->pipeline_cache_path);
+  free(r->wanted_device_name);
   free(r->phys_devices);
-  r->vkDestroySwapchainKHR(r->device, r->swapchain, NULL);
-  r->vkDestroySurfaceKHR(r->instance, r->surface, NULL);
-  r->vkDestroyDevice(r->device, NULL);
+  if (!r->headless) r->vkDestroySurfaceKHR(r->instance, r->surface, NULL);
   r->vkDestroyInstance(r->instance, NULL);
   dlclose(r->vklib);
   memset((void *) r, 0, sizeof(struct render));
@@ -1040,122 +4689,736 @@ int render_configure(
   char *vshader,
   char *fshader
 ) {
-  VkVertexInputBindingDescription bindings[] = {
-    { 0, sizeof(float) * 6, VK_VERTEX_INPUT_RATE_VERTEX }
-  };
-  VkVertexInputAttributeDescription attrs[] = {
-    { 0, 0, VK_FORMAT_R32G32B32_SFLOAT, 0 },
-    { 1, 0, VK_FORMAT_R32G32B32_SFLOAT, sizeof(float) * 3 }
-  };
+  struct render_pipeline_info info = { 0 };
 
   if (!r) return RENDER_ERROR_NULL;
   render_destroy_pipeline(r);
-  r->phys_id = 0;
-
-  chkerrf(get_queue_props(r),       { render_destroy_pipeline(r); });
-  chkerrf(get_queue_indices(r),     { render_destroy_pipeline(r); });
-  chkerrf(create_device(r),         { render_destroy_pipeline(r); });
-  chkerrf(load_device_functions(r), { render_destroy_pipeline(r); });
-  chkerrf(get_surface_format(r),    { render_destroy_pipeline(r); });
-  chkerrf(create_swapchain(r),      { render_destroy_pipeline(r); });
-  chkerrf(create_pipeline(
-    r,
-    sizeof(bindings) / sizeof(bindings[0]),
-    bindings,
-    sizeof(attrs) / sizeof(attrs[0]),
-    attrs,
-    vshader,
-    fshader
-  ), {
-    render_destroy_pipeline(r);
-  });
-  chkerrf(create_framebuffers(r),    { render_destroy_pipeline(r); });
-  chkerrf(create_command_pool(r),    { render_destroy_pipeline(r); });
-  chkerrf(create_command_buffers(r), { render_destroy_pipeline(r); });
-  chkerrf(create_vertex_data(r),     { render_destroy_pipeline(r); });
-  chkerrf(write_buffers(r),          { render_destroy_pipeline(r); });
-  chkerrf(create_semaphores(r),      { render_destroy_pipeline(r); });
+  chkerr(profiled(r, select_device(r)));
+  get_device_properties(r);
+  init_tables(r);
+  info.vshader = vshader;
+  info.fshader = fshader;
+  r->requested_extent.width = width;
+  r->requested_extent.height = height;
+
+  /* Only the device and queue properties exist until its functions load */
+#define early_step(call) \
+  chkerrf(profiled(r, call), { destroy_device(r); })
+#define step(call) \
+  chkerrf(profiled(r, call), { destroy_configured(r); })
+
+  early_step(get_queue_props(r));
+  early_step(get_queue_indices(r));
+  early_step(get_transfer_queue_index(r));
+  early_step(create_device(r));
+  early_step(load_device_functions(r));
+  step(create_pipeline_cache(r));
+  step(get_surface_format(r));
+  step(create_render_targets(r));
+  step(create_render_pass(r));
+  step(create_descriptor_set_layout(r));
+  step(add_pipeline(r, &info, &r->default_pipeline));
+  step(create_framebuffers(r));
+  step(create_frames(r));
+  step(create_command_pool(r));
+  step(create_command_buffers(r));
+  step(create_static_buffers(r));
+  step(create_present_buffers(r));
+  step(create_workers(r));
+  step(create_upload(r));
+  step(create_ring(r));
+  step(create_descriptors(r));
   r->has_pipeline = 1;
+
+#undef early_step
+#undef step
   return RENDER_ERROR_NONE;
 }
 
 void render_destroy_pipeline(struct render *r) {
   if (!r) return;
-  if (r->has_pipeline) {
-    size_t i;
+  if (r->has_pipeline) destroy_configured(r);
+}
 
-    r->vkDestroySemaphore(r->device, r->image_semaphore, NULL);
-    r->vkDestroySemaphore(r->device, r->render_semaphore, NULL);
-    r->vkDestroyBuffer(r->device, r->vertex_buffer, NULL);
-    r->vkDestroyBuffer(r->device, r->index_buffer, NULL);
-    r->vkFreeMemory(r->device, r->vertex_memory, NULL);
-    r->vkFreeMemory(r->device, r->index_memory, NULL);
-    r->vkFreeCommandBuffers(
-      r->device,
-      r->command_pool,
-      (uint32_t) r->n_swapchain_images,
-      r->command_buffers
+/**
+ * Overrides device scoring: name matches any device whose name contains
+ * it, uuid is VK_UUID_SIZE bytes of deviceUUID. Either may be NULL, both
+ * NULL goes back to scoring. Takes effect on the next render_configure()
+ */
+int render_set_device(
+  struct render *r,
+  const char *name,
+  const uint8_t *uuid
+) {
+  char *copy = NULL;
+
+  if (!r) return RENDER_ERROR_NULL;
+  if (name) {
+    copy = malloc(strlen(name) + 1);
+    if (!copy) return RENDER_ERROR_MEMORY;
+    strcpy(copy, name);
+  }
+  free(r->wanted_device_name);
+  r->wanted_device_name = copy;
+  r->has_wanted_uuid = uuid != NULL;
+  if (uuid) memcpy(r->wanted_device_uuid, uuid, VK_UUID_SIZE);
+  return RENDER_ERROR_NONE;
+}
+
+int render_get_device_info(struct render *r, struct render_device_info *out) {
+  if (!r || !out) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  *out = r->device_info;
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_frames_in_flight(struct render *r, size_t n) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (n < 1 || n > RENDER_MAX_FRAMES_IN_FLIGHT) return RENDER_ERROR_ARGUMENT;
+  /* Takes effect on the next render_configure() */
+  r->frames_in_flight = n;
+  return RENDER_ERROR_NONE;
+}
+
+int render_load(
+  struct render *r,
+  size_t n,
+  void *data,
+  size_t stride,
+  size_t n_indices,
+  void *indices,
+  size_t index_size,
+  render_handle *out_mesh
+) {
+  if (!r || !data || !indices || !out_mesh) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  if (!n || !stride || n % stride || !n_indices) return RENDER_ERROR_ARGUMENT;
+  /* Every pipeline reads binding 0 with the one mesh layout */
+  if (stride != default_bindings[0].stride) return RENDER_ERROR_ARGUMENT;
+  if (index_size != sizeof(uint16_t) && index_size != sizeof(uint32_t)) {
+    return RENDER_ERROR_ARGUMENT;
+  }
+  return load_mesh(
+    r,
+    n,
+    data,
+    stride,
+    n_indices,
+    indices,
+    index_size,
+    out_mesh
+  );
+}
+
+int render_unload(struct render *r, render_handle mesh) {
+  struct render_mesh *m;
+
+  if (!r) return RENDER_ERROR_NULL;
+  m = handle_table_get(&r->meshes, mesh);
+  if (!m) return RENDER_ERROR_HANDLE;
+  if (r->n_retired_meshes == r->cap_retired_meshes) {
+    size_t cap = r->cap_retired_meshes ? r->cap_retired_meshes * 2 : 16;
+    struct render_mesh *retired;
+
+    retired = realloc(r->retired_meshes, sizeof(struct render_mesh) * cap);
+    if (!retired) return RENDER_ERROR_MEMORY;
+    r->retired_meshes = retired;
+    r->cap_retired_meshes = cap;
+  }
+  /* The frame being recorded may still draw it */
+  m->serial = r->frame_serial + 1;
+  ++r->draws_generation;
+  r->retired_meshes[r->n_retired_meshes++] = *m;
+  handle_table_free(&r->meshes, mesh);
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_worker_threads(struct render *r, size_t n) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (n > RENDER_MAX_WORKER_THREADS) return RENDER_ERROR_ARGUMENT;
+  /* Takes effect on the next render_configure(), 0 records inline */
+  r->wanted_workers = n;
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_ring_size(struct render *r, size_t size) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (size == 0) return RENDER_ERROR_ARGUMENT;
+  /* Takes effect on the next render_configure() */
+  r->ring_size = size;
+  return RENDER_ERROR_NONE;
+}
+
+int render_ring_alloc(
+  struct render *r,
+  size_t size,
+  size_t alignment,
+  struct render_ring_range *out
+) {
+  VkDeviceSize offset;
+
+  if (!r || !out) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  if (size == 0 || size > r->ring.size) return RENDER_ERROR_ARGUMENT;
+  chkerr(begin_frame(r));
+  chkerr(ring_alloc(r, size, alignment, &offset));
+  out->data = (unsigned char *) r->ring.alloc.mapped + offset;
+  out->buffer = r->ring.buffer;
+  out->offset = offset;
+  return RENDER_ERROR_NONE;
+}
+
+int render_resize(struct render *r, unsigned int width, unsigned int height) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  /* Offscreen targets can't be minimized, keep the old ones */
+  if (r->headless && (width == 0 || height == 0)) {
+    return RENDER_ERROR_ARGUMENT;
+  }
+  r->requested_extent.width = width;
+  r->requested_extent.height = height;
+  return recreate_swapchain(r);
+}
+
+int render_set_present_mode(struct render *r, VkPresentModeKHR mode) {
+  if (!r) return RENDER_ERROR_NULL;
+  switch (mode) {
+  case VK_PRESENT_MODE_IMMEDIATE_KHR:
+  case VK_PRESENT_MODE_MAILBOX_KHR:
+  case VK_PRESENT_MODE_FIFO_KHR:
+  case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+    break;
+  default:
+    return RENDER_ERROR_ARGUMENT;
+  }
+  /* Takes effect the next time the swapchain is created */
+  r->wanted_present_mode = mode;
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_image_count(struct render *r, size_t n) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (n < 2) return RENDER_ERROR_ARGUMENT;
+  /* Takes effect the next time the swapchain is created */
+  r->wanted_image_count = n;
+  return RENDER_ERROR_NONE;
+}
+
+int render_get_swapchain_info(
+  struct render *r,
+  struct render_swapchain_info *out
+) {
+  if (!r || !out) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  out->present_mode = r->present_mode;
+  out->n_images = r->n_swapchain_images;
+  out->extent = r->swap_extent;
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_pipeline_cache_path(struct render *r, const char *path) {
+  char *copy = NULL;
+
+  if (!r) return RENDER_ERROR_NULL;
+  if (path) {
+    copy = malloc(strlen(path) + 1);
+    if (!copy) return RENDER_ERROR_MEMORY;
+    strcpy(copy, path);
+  }
+  free(r->pipeline_cache_path);
+  /* Loaded on the next render_configure(), saved when it is torn down */
+  r->pipeline_cache_path = copy;
+  return RENDER_ERROR_NONE;
+}
+
+int render_save_pipeline_cache(struct render *r) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  return save_pipeline_cache(r);
+}
+
+int render_get_pipeline_cache_stats(
+  struct render *r,
+  struct render_pipeline_cache_stats *out
+) {
+  if (!r || !out) return RENDER_ERROR_NULL;
+  *out = r->pipeline_cache_stats;
+  return RENDER_ERROR_NONE;
+}
+
+int render_add_pipeline(
+  struct render *r,
+  struct render_pipeline_info *info,
+  render_handle *out_pipeline
+) {
+  if (!r || !info || !out_pipeline) return RENDER_ERROR_NULL;
+  if (!info->vshader || !info->fshader) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  chkerr(check_pipeline_info(r, info));
+  return add_pipeline(r, info, out_pipeline);
+}
+
+/**
+ * Returns a handle right away and compiles the pipeline in the
+ * background. Until render_pipeline_status() reports it ready its draws
+ * use fallback, which has to take the same vertex input, or are skipped
+ * when that is RENDER_HANDLE_NULL
+ */
+int render_add_pipeline_async(
+  struct render *r,
+  struct render_pipeline_info *info,
+  render_handle fallback,
+  render_handle *out_pipeline
+) {
+  if (!r || !info || !out_pipeline) return RENDER_ERROR_NULL;
+  if (!info->vshader || !info->fshader) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  chkerr(check_pipeline_info(r, info));
+  if (fallback) {
+    struct render_pipeline *p = handle_table_get(&r->pipelines, fallback);
+    struct render_pipeline_desc desc;
+
+    if (!p) return RENDER_ERROR_HANDLE;
+    memset(&desc, 0, sizeof(struct render_pipeline_desc));
+    set_vertex_input(&desc, info);
+    if (  desc.n_bindings != p->desc.n_bindings
+       || desc.n_attrs != p->desc.n_attrs
+       || memcmp(desc.bindings, p->desc.bindings, sizeof(desc.bindings))
+       || memcmp(desc.attrs, p->desc.attrs, sizeof(desc.attrs))
+       ) {
+      return RENDER_ERROR_ARGUMENT;
+    }
+  }
+  return add_pipeline_async(r, info, fallback, out_pipeline);
+}
+
+/* RENDER_PIPELINE_READY, RENDER_PIPELINE_PENDING or why it failed */
+int render_pipeline_status(struct render *r, render_handle pipeline) {
+  struct render_pipeline *p;
+
+  if (!r) return RENDER_ERROR_NULL;
+  collect_pipelines(r);
+  p = handle_table_get(&r->pipelines, pipeline);
+  if (!p) return RENDER_ERROR_HANDLE;
+  return p->status;
+}
+
+int render_set_compile_threads(struct render *r, size_t n) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (n > RENDER_MAX_WORKER_THREADS) return RENDER_ERROR_ARGUMENT;
+  /**
+   * Takes effect when the compiler next starts, on the first async add
+   * after render_configure(). 0 compiles on the calling thread
+   */
+  r->wanted_compile_threads = n;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Undoes one render_add_pipeline(). Identical descriptions share a handle,
+ * which stays valid until every one of them has been removed
+ */
+int render_remove_pipeline(struct render *r, render_handle pipeline) {
+  struct render_pipeline *p;
+
+  if (!r) return RENDER_ERROR_NULL;
+  p = handle_table_get(&r->pipelines, pipeline);
+  if (!p) return RENDER_ERROR_HANDLE;
+  if (p->refs > 1) {
+    --p->refs;
+    return RENDER_ERROR_NONE;
+  }
+  if (pipeline == r->default_pipeline) return RENDER_ERROR_ARGUMENT;
+  if (p->status == RENDER_PIPELINE_PENDING) {
+    /* A compile thread is still writing the pipeline */
+    drain_compiler(r);
+    p = handle_table_get(&r->pipelines, pipeline);
+  }
+  /* Pipelines come and go rarely, so just let in-flight frames drain */
+  r->vkDeviceWaitIdle(r->device);
+  unindex_pipeline(r, pipeline);
+  destroy_pipeline_record(r, p);
+  handle_table_free(&r->pipelines, pipeline);
+  ++r->draws_generation;
+  return RENDER_ERROR_NONE;
+}
+
+int render_draw(struct render *r, struct render_draw_info *info) {
+  struct render_draw_item *item;
+  struct render_pipeline *p;
+  struct render_mesh *mesh;
+  render_handle pipeline;
+  VkDeviceSize instance_size = 0;
+
+  if (!r || !info) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  if (info->data_size && !info->data) return RENDER_ERROR_NULL;
+  if (info->data_size > r->uniform_range) return RENDER_ERROR_ARGUMENT;
+  if (info->push_size && !info->push_data) return RENDER_ERROR_NULL;
+  pipeline = info->pipeline ? info->pipeline : r->default_pipeline;
+  p = handle_table_get(&r->pipelines, pipeline);
+  if (!p) return RENDER_ERROR_HANDLE;
+  mesh = handle_table_get(&r->meshes, info->mesh);
+  if (!mesh) return RENDER_ERROR_HANDLE;
+  if (info->push_size % 4 || info->push_size > p->desc.push_constant_size) {
+    return RENDER_ERROR_ARGUMENT;
+  }
+  if (p->desc.n_bindings > 1) {
+    /* The instance stream has to come from somewhere */
+    if (!info->n_instances) return RENDER_ERROR_ARGUMENT;
+    instance_size =
+      (VkDeviceSize) info->n_instances * p->desc.bindings[1].stride;
+    if (  !info->instances
+       && (  info->instance_offset > r->ring.size
+          || instance_size > r->ring.size - info->instance_offset
+          )
+       ) {
+      return RENDER_ERROR_ARGUMENT;
+    }
+  }
+  /* The ring is recycled every frame, replayed buffers would read junk */
+  if (  (info->data_size || instance_size)
+     && r->record_mode == RENDER_RECORD_STATIC
+     ) {
+    return RENDER_ERROR_ARGUMENT;
+  }
+  if (r->n_draws == r->cap_draws) {
+    size_t cap = r->cap_draws ? r->cap_draws * 2 : 256;
+    struct render_draw_item *draws;
+
+    draws = realloc(r->draws, sizeof(struct render_draw_item) * cap);
+    if (!draws) return RENDER_ERROR_MEMORY;
+    r->draws = draws;
+    r->cap_draws = cap;
+  }
+  chkerr(begin_frame(r));
+  item = r->draws + r->n_draws;
+  item->data_offset = 0;
+  item->data_size = info->data_size;
+  if (info->data_size) {
+    VkDeviceSize offset;
+
+    /* Just the data, the window past it is covered in render_update() */
+    chkerr(ring_alloc(
+      r,
+      info->data_size,
+      r->phys_props.limits.minUniformBufferOffsetAlignment,
+      &offset
+    ));
+    memcpy(
+      (unsigned char *) r->ring.alloc.mapped + offset,
+      info->data,
+      info->data_size
     );
-    free(r->command_buffers);
-    r->vkDestroyCommandPool(r->device, r->command_pool, NULL);
-    for (i = 0; i < r->n_swapchain_images; ++i) {
-      r->vkDestroyFramebuffer(r->device, r->framebuffers[i], NULL);
-      r->vkDestroyImageView(r->device, r->image_views[i], NULL);
+    item->data_offset = offset;
+  }
+  item->n_instances = info->n_instances ? info->n_instances : 1;
+  item->instance_offset = info->instance_offset;
+  if (instance_size && info->instances) {
+    VkDeviceSize offset;
+
+    chkerr(ring_alloc(r, instance_size, 16, &offset));
+    memcpy(
+      (unsigned char *) r->ring.alloc.mapped + offset,
+      info->instances,
+      (size_t) instance_size
+    );
+    item->instance_offset = offset;
+  }
+  item->push_offset = r->push_used;
+  item->push_size = (uint32_t) info->push_size;
+  if (info->push_size) {
+    if (r->push_used + info->push_size > r->cap_push) {
+      size_t cap = r->cap_push ? r->cap_push : 4096;
+      unsigned char *push_data;
+
+      while (cap < r->push_used + info->push_size) cap *= 2;
+      push_data = realloc(r->push_data, cap);
+      if (!push_data) return RENDER_ERROR_MEMORY;
+      r->push_data = push_data;
+      r->cap_push = cap;
     }
-    free(r->framebuffers);
-    free(r->image_views);
-    free(r->swapchain_images);
-    /* r->vkDestroyShaderModule(r->device, r->vert_module, NULL); */
-    /* r->vkDestroyShaderModule(r->device, r->frag_module, NULL); */
-    r->vkDestroyPipeline(r->device, r->pipeline, NULL);
-    r->vkDestroyRenderPass(r->device, r->render_pass, NULL);
-    free(r->queue_props);
-    r->has_pipeline = 0;
+    memcpy(r->push_data + r->push_used, info->push_data, info->push_size);
+    r->push_used += info->push_size;
+  }
+  item->pipeline = pipeline;
+  item->mesh = info->mesh;
+  item->key = (uint64_t) r->draw_segment << 52
+    | (uint64_t) (pipeline & HANDLE_INDEX_MASK) << 32
+    | (uint64_t) (mesh->geometry & 0xfff) << 20
+    | (uint64_t) (mesh->index_type == VK_INDEX_TYPE_UINT32) << 19;
+  item->order = r->n_draws;
+  ++r->n_draws;
+  ++r->draws_generation;
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_record_mode(struct render *r, int mode) {
+  size_t i;
+
+  if (!r) return RENDER_ERROR_NULL;
+  if (mode != RENDER_RECORD_DYNAMIC && mode != RENDER_RECORD_STATIC) {
+    return RENDER_ERROR_ARGUMENT;
   }
+  /* Per-draw data already in the list lives in the ring */
+  for (i = 0; mode == RENDER_RECORD_STATIC && i < r->n_draws; ++i) {
+    if (r->draws[i].data_size) return RENDER_ERROR_ARGUMENT;
+  }
+  r->record_mode = mode;
+  ++r->draws_generation;
+  return RENDER_ERROR_NONE;
+}
+
+/* Static mode keeps the draw list across frames until this is called */
+int render_clear_draws(struct render *r) {
+  if (!r) return RENDER_ERROR_NULL;
+  clear_draws(r);
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_draw_indirect(struct render *r, int enabled) {
+  if (!r) return RENDER_ERROR_NULL;
+  /* Applies from the next recorded frame */
+  r->draw_indirect = enabled;
+  return RENDER_ERROR_NONE;
+}
+
+int render_set_gpu_timing(struct render *r, int enabled) {
+  if (!r) return RENDER_ERROR_NULL;
+  /* Takes effect on the next render_configure() */
+  r->wants_gpu_timing = enabled;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Draws queued after this go to area of the target, NULL going back to
+ * all of it. Only the viewport and scissor change, so it costs no
+ * pipeline work and can split the screen any number of ways in a frame
+ */
+int render_set_viewport(struct render *r, const struct render_viewport *area) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  if (area && (area->x < 0 || area->y < 0)) return RENDER_ERROR_ARGUMENT;
+  chkerr(push_marker(r, RENDER_MARKER_VIEWPORT, NULL));
+  if (area) r->markers[r->n_markers - 1].viewport = *area;
+  return RENDER_ERROR_NONE;
+}
+
+int render_begin_region(struct render *r, const char *label) {
+  if (!r || !label) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  if (!r->gpu_timing) return RENDER_ERROR_NONE;
+  return push_marker(r, RENDER_MARKER_BEGIN_REGION, label);
+}
+
+int render_end_region(struct render *r) {
+  if (!r) return RENDER_ERROR_NULL;
+  if (!r->has_pipeline) return RENDER_ERROR_NULL;
+  if (!r->gpu_timing) return RENDER_ERROR_NONE;
+  return push_marker(r, RENDER_MARKER_END_REGION, NULL);
+}
+
+/* Timings of the newest frame the GPU has finished, never waits */
+int render_get_gpu_timings(struct render *r, struct render_gpu_timings *out) {
+  if (!r || !out) return RENDER_ERROR_NULL;
+  if (!r->gpu_timing) return RENDER_ERROR_UNSUPPORTED;
+  *out = r->gpu_timings;
+  return RENDER_ERROR_NONE;
+}
+
+/**
+ * Writes the profiler's ring buffer as Chrome trace-event JSON, loadable
+ * in chrome://tracing or Perfetto. Without RENDER_PROFILE there is
+ * nothing to write
+ */
+int render_profile_dump(struct render *r, const char *path) {
+#ifdef RENDER_PROFILE
+  size_t i, first;
+  FILE *f;
+
+  if (!r || !path) return RENDER_ERROR_NULL;
+  f = fopen(path, "w");
+  if (!f) return RENDER_ERROR_FILE;
+  fprintf(f, "{\"traceEvents\":[\n");
+  first = (r->profile_head + RENDER_PROFILE_EVENTS - r->profile_count)
+        % RENDER_PROFILE_EVENTS;
+  for (i = 0; i < r->profile_count; ++i) {
+    struct render_profile_event *e;
+    size_t len;
+
+    e = r->profile_events + (first + i) % RENDER_PROFILE_EVENTS;
+    /* Names are call expressions, keep just the function */
+    len = strcspn(e->name, "(");
+    fprintf(
+      f,
+      "{\"name\":\"%.*s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+      "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"depth\":%lu}}%s\n",
+      (int) len,
+      e->name,
+      (double) e->start_ns / 1e3,
+      (double) e->duration_ns / 1e3,
+      (unsigned long) e->depth,
+      i + 1 < r->profile_count ? "," : ""
+    );
+  }
+  fprintf(f, "]}\n");
+  if (fclose(f) != 0) return RENDER_ERROR_FILE;
+  return RENDER_ERROR_NONE;
+#else
+  if (!r || !path) return RENDER_ERROR_NULL;
+  return RENDER_ERROR_UNSUPPORTED;
+#endif
 }
 
 int render_update(struct render *r) {
   uint32_t image_index;
+  struct render_frame *frame;
+  VkCommandBuffer cb, cbs[2];
+  VkSemaphore wait_semaphores[2];
+  VkPipelineStageFlags wait_stages[2];
+  uint32_t n_cbs = 0, n_waits = 0;
+  int acquired;
   VkSubmitInfo submit_info = { 0 };
-  VkPipelineStageFlags wait_stages[] = {
-    VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
-  };
   VkPresentInfoKHR present_info = { 0 };
   VkResult result;
 
-  result = r->vkAcquireNextImageKHR(
-    r->device,
-    r->swapchain,
-    (uint64_t) 2e9L,
-    r->image_semaphore,
-    VK_NULL_HANDLE,
-    &image_index
-  );
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_ACQUIRE_IMAGE;
+  if (!r) return RENDER_ERROR_NULL;
+  /* Before recording, so finished pipelines replace their fallbacks */
+  collect_pipelines(r);
+  if (r->swapchain_dirty) chkerr(recreate_swapchain(r));
+  frame = r->frames + r->frame_index;
+  /* Only blocks if the GPU is still using this frame's resources */
+  chkerr(profiled(r, begin_frame(r)));
+  if (r->swapchain_dirty) {
+    /* Still minimized, drop the frame */
+    drop_frame(r);
+    return RENDER_ERROR_NONE;
+  }
+  if (r->headless) {
+    /* Offscreen targets are simply used round robin */
+    image_index = (uint32_t) r->target_index;
+    r->target_index = (r->target_index + 1) % r->n_swapchain_images;
+  } else {
+    result = profiled_vk(
+      r,
+      "vkAcquireNextImageKHR",
+      r->vkAcquireNextImageKHR(
+        r->device,
+        r->swapchain,
+        (uint64_t) 2e9L,
+        frame->image_semaphore,
+        VK_NULL_HANDLE,
+        &image_index
+      )
+    );
+    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+      /**
+       * Nothing was acquired, so the frame is dropped like a minimized
+       * one. Keeping the draws would draw them twice next time around
+       */
+      drop_frame(r);
+      return recreate_swapchain(r);
+    }
+    /* Suboptimal still signals the semaphore, so finish this frame first */
+    if (result == VK_SUBOPTIMAL_KHR) r->swapchain_dirty = 1;
+    else if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_ACQUIRE_IMAGE;
+  }
+  /* The image may be out of order and still in use by an older frame */
+  if (  r->image_fences[image_index]
+     && r->image_fences[image_index] != frame->fence
+     ) {
+    chkerr(wait_fence(r, r->image_fences[image_index]));
+  }
+  r->image_fences[image_index] = frame->fence;
+  chkerr(profiled(r, record_frame(r, image_index, &cb)));
+  if (r->ring.head != r->ring.frame_start) {
+    VkDeviceSize pad;
+
+    /* Keeps the last draw's uniform window clear of the next frame */
+    chkerr(ring_alloc(r, r->uniform_range, 1, &pad));
+  }
+  chkerr(flush_ring(r));
+  /* Meshes loaded since the last frame go out in one batch ahead of it */
+  chkerr(profiled(r, upload_submit(r, 1)));
+  chkerr(upload_acquire(r, frame, &acquired));
+  if (acquired) cbs[n_cbs++] = frame->acquire_buffer;
+  cbs[n_cbs++] = cb;
+  /**
+   * Only once nothing else can fail, an unsignaled fence with no submit
+   * behind it would hang the next begin_frame()
+   */
+  result = r->vkResetFences(r->device, 1, &frame->fence);
+  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_FENCE;
+  if (!r->headless) {
+    wait_semaphores[n_waits] = frame->image_semaphore;
+    wait_stages[n_waits++] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  }
+  if (r->upload.signaled) {
+    wait_semaphores[n_waits] = r->upload.semaphore;
+    wait_stages[n_waits++] = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    r->upload.signaled = 0;
+  }
+  frame->ring_end = r->ring.head;
+  frame->serial = ++r->frame_serial;
   submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submit_info.waitSemaphoreCount = 1;
-  submit_info.pWaitSemaphores = &r->image_semaphore;
+  submit_info.waitSemaphoreCount = n_waits;
+  submit_info.pWaitSemaphores = wait_semaphores;
   submit_info.pWaitDstStageMask = wait_stages;
-  submit_info.commandBufferCount = 1;
-  /* &r->command_buffers[image_index] */
-  submit_info.pCommandBuffers = r->command_buffers + image_index;
-  submit_info.signalSemaphoreCount = 1;
-  submit_info.pSignalSemaphores = &r->render_semaphore;
-  result = r->vkQueueSubmit(
-    r->graphics_queue,
-    1,
-    &submit_info,
-    VK_NULL_HANDLE
+  submit_info.commandBufferCount = n_cbs;
+  submit_info.pCommandBuffers = cbs;
+  submit_info.signalSemaphoreCount = r->headless ? 0 : 1;
+  submit_info.pSignalSemaphores = &frame->render_semaphore;
+  result = profiled_vk(
+    r,
+    "vkQueueSubmit",
+    r->vkQueueSubmit(r->graphics_queue, 1, &submit_info, frame->fence)
   );
   if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_QUEUE_SUBMIT;
+  if (r->record_mode == RENDER_RECORD_DYNAMIC) clear_draws(r);
+  if (r->headless) {
+    r->frame_index = (r->frame_index + 1) % r->n_frames;
+    r->frame_begun = 0;
+    return RENDER_ERROR_NONE;
+  }
   present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
   present_info.waitSemaphoreCount = 1;
-  present_info.pWaitSemaphores = &r->render_semaphore;
+  present_info.pWaitSemaphores = &frame->render_semaphore;
+  if (separate_present(r)) {
+    VkSubmitInfo acquire_info = { 0 };
+    VkPipelineStageFlags acquire_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+
+    /* The present family takes the image before presenting it */
+    acquire_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    acquire_info.waitSemaphoreCount = 1;
+    acquire_info.pWaitSemaphores = &frame->render_semaphore;
+    acquire_info.pWaitDstStageMask = &acquire_stage;
+    acquire_info.commandBufferCount = 1;
+    acquire_info.pCommandBuffers = r->present_buffers + image_index;
+    acquire_info.signalSemaphoreCount = 1;
+    acquire_info.pSignalSemaphores = &frame->present_semaphore;
+    result = r->vkQueueSubmit(
+      r->present_queue,
+      1,
+      &acquire_info,
+      VK_NULL_HANDLE
+    );
+    if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_QUEUE_SUBMIT;
+    present_info.pWaitSemaphores = &frame->present_semaphore;
+  }
   present_info.swapchainCount = 1;
   present_info.pSwapchains = &r->swapchain;
   present_info.pImageIndices = &image_index;
-  result = r->vkQueuePresentKHR(r->present_queue, &present_info);
-  if (result != VK_SUCCESS) return RENDER_ERROR_VULKAN_QUEUE_PRESENT;
-  r->vkQueueWaitIdle(r->present_queue);
+  result = profiled_vk(
+    r,
+    "vkQueuePresentKHR",
+    r->vkQueuePresentKHR(r->present_queue, &present_info)
+  );
+  r->frame_index = (r->frame_index + 1) % r->n_frames;
+  r->frame_begun = 0;
+  if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+    r->swapchain_dirty = 1;
+  } else if (result != VK_SUCCESS) {
+    return RENDER_ERROR_VULKAN_QUEUE_PRESENT;
+  }
   return RENDER_ERROR_NONE;
 }